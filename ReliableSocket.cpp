@@ -10,151 +10,323 @@
 // C++ library includes
 #include <iostream>
 #include <string.h>
+#include <algorithm>
+#include <cerrno>
 
 // OS specific includes
 #include <unistd.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <time.h>
+
+// zlib for stream compression
+#include <zlib.h>
 
 #include "ReliableSocket.h"
 #include "rdt_time.h"
+#include "rdt_fec.h"
+#include "rdt_crypto.h"
+#include "rdt_seq.h"
+#include "rdt_addr.h"
+#include "rdt_rate.h"
 
 using std::cerr;
 
+RateBucket *ReliableSocket::global_rate_limit = rate_new();
+
 /*
  * NOTE: Function header comments shouldn't go in this file: they should be put
  * in the ReliableSocket header file.
  */
 
 ReliableSocket::ReliableSocket() {
-	this->sequence_number = 0;
-	this->expected_sequence_number = 0;
+	this->sequence_number = 0; // picked when connecting
+	this->expected_sequence_number = 0; // learned from the remote host's ISN
 	this->estimated_rtt = 100;
 	this->dev_rtt = 10;
 	this->current_rtt =0;
 
 	// create new fields in your class, they should be
 	// initialized here.
+	this->compression_enabled = false;
+	this->options = 0;
+	this->have_psk = false;
+	this->crypto = NULL;
+	this->deflater = NULL;
+	this->deflate_out_len = 0;
+	this->compress_level = 6; // zlib's default level
+	this->compress_block_in = 0;
+	this->compress_block_out = 0;
+	this->compress_block_nsec = 0;
+	this->compress_probe_countdown = 0;
+	this->compress_total_in = 0;
+	this->compress_total_out = 0;
+	this->inflater = NULL;
+	this->inflate_more = false;
+	this->fec_group_size = 0;
+	this->fec_auto = false;
+	this->loss_rate = 0;
+	this->fec_recv_size = 0;
+	this->fec_recv_mask = 0;
+	this->fec_recv_count = 0;
+	this->fec_have_parity = false;
+	this->fec_parity_len_xor = 0;
+	this->fec_done_base = 0;
+	this->fec_done_size = 0;
+	this->resume_offer_offset = 0;
+	this->resume_offer_hash = 0;
+	this->resume_pending = false;
+	this->resume_offset = 0;
+	this->corked = false;
+	this->cork_pending = false;
+	this->cork_start = 0;
+	this->send_has_deadline = false;
+	this->send_deadline = 0;
+	this->send_retransmits_left = -1;
+	this->drr_stream = -1;
+	this->idle_timeout = 0;
+	this->keepalive_interval = 0;
+	this->last_heard = 0;
+	this->last_sent = 0;
+	this->connection_id = 0;
+	memset(&this->peer_addr, 0, sizeof(this->peer_addr));
+	this->challenge_pending = false;
+	memset(&this->challenge_addr, 0, sizeof(this->challenge_addr));
+	this->challenge_sent = 0;
+	this->rate_limit = NULL;
 
-	this->sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	this->state = INIT;
+	this->timeout_length = 0;
+	// A dual-stack IPv6 socket talks to IPv4 hosts too (at IPv4-mapped
+	// addresses). Hosts without IPv6 get a plain IPv4 socket.
+	this->family = AF_INET6;
+	this->sock_fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (this->sock_fd >= 0) {
+		int v6only = 0;
+		if (setsockopt(this->sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+			perror("IPV6_V6ONLY");
+		}
+	}
+	else {
+		this->family = AF_INET;
+		this->sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	}
 	if (this->sock_fd < 0) {
-		perror("socket");
-		exit(EXIT_FAILURE);
+		this->fail(errno);
 	}
-
-	this->state = INIT;
 }
 
-void ReliableSocket::accept_connection(int port_num) {
+bool ReliableSocket::accept_connection(int port_num) {
+	if (this->state == FAILED) {
+		return false;
+	}
 	if (this->state != INIT) {
 		cerr << "Cannot call accept on used socket\n";
-		exit(EXIT_FAILURE);
+		return false;
 	}
 
-	// Bind specified port num using our local IPv4 address.
+	// Bind specified port num on all our local addresses (IPv6 and IPv4).
 	// This allows remote hosts to connect to a specific port.
-	struct sockaddr_in addr; 
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port_num);
-	addr.sin_addr.s_addr = INADDR_ANY;
-	if ( bind(this->sock_fd, (struct sockaddr*)&addr, sizeof(addr)) ) {
-		perror("bind");
+	struct sockaddr_storage addr;
+	addr_any(this->family, port_num, addr);
+	if ( bind(this->sock_fd, (struct sockaddr*)&addr, addr_length(addr)) ) {
+		this->fail(errno);
+		return false;
 	}
 
 	// Wait for a segment to come from a remote host
 	char segment[MAX_SEG_SIZE];
-	memset(segment, 0, MAX_SEG_SIZE);
-
-	struct sockaddr_in fromaddr;
-	unsigned int addrlen = sizeof(fromaddr);
-	int recv_count = recvfrom(this->sock_fd, segment, MAX_SEG_SIZE, 0, (struct sockaddr*)&fromaddr, &addrlen);		
-	if (recv_count < 0) {
-		perror("accept recvfrom");
-		exit(EXIT_FAILURE);
+	struct sockaddr_storage from;
+	socklen_t addrlen;
+	RDTHeader* hdr = (RDTHeader*)segment;
+	if (!crypto_random(this->cookie_secret, sizeof(this->cookie_secret))) {
+		this->fail(EIO);
+		return false;
 	}
 
-	/*
-	 * UDP isn't connection-oriented, but calling connect here allows us to
-	 * remember the remote host (stored in fromaddr).
-	 * This means we can then use send and recv instead of the more complex
-	 * sendto and recvfrom.
-	 */
-	if (connect(this->sock_fd, (struct sockaddr*)&fromaddr, addrlen)) {
-		perror("accept connect");
-		exit(EXIT_FAILURE);
-	}
+	while (1) {
+		memset(segment, 0, MAX_SEG_SIZE);
+		memset(&from, 0, sizeof(from));
+		addrlen = sizeof(from);
+		int recv_count = recvfrom(this->sock_fd, segment, MAX_SEG_SIZE, 0, (struct sockaddr*)&from, &addrlen);
+		if (recv_count < 0) {
+			this->fail(errno);
+			return false;
+		}
 
-	// Check that segment was the right type of message, namely a RDT_CONN
-	// message to indicate that the remote host wants to start a new
-	// connection with us.
-	RDTHeader* hdr = (RDTHeader*)segment;
-	cerr << hdr->type << "\n";
-	cerr << RDT_SYN;
-	if (hdr->type != RDT_SYN) {
-		cerr << "ERROR: Didn't get the expected RDT_SYN type.\n";
-		exit(EXIT_FAILURE);
+		// A RDT_SYN (signed with our pre-shared key, if we have one) is
+		// answered with a SYN cookie, and nothing is kept for it, so forged
+		// SYNs cost little and can't stop a real one getting through. The
+		// connection is only set up once the cookie is echoed back.
+		// Anything else is ignored, quietly, since logging every forged
+		// segment would cost more than checking it.
+		if (hdr->type == RDT_SYN) {
+			if (!this->have_psk || this->handshake_valid(segment)) {
+				this->answer_syn(segment, from);
+			}
+		}
+		else if (hdr->type == RDT_COOKIE_ECHO && this->accept_cookie(segment, from)) {
+			break;
+		}
 	}
 
-	//  implement a handshaking protocol to make sure that
-	// both sides are correctly connected (e.g. what happens if the RDT_CONN
-	// message from the other end gets lost?)
-	// Note that this function is called by the connection receiver/listener.
+	// Let the remote host know, or it will keep echoing the cookie
+	this->state = ESTABLISHED;
+	this->answer_stray(segment);
+	cerr << "INFO: Connection ESTABLISHED\n";
+	return true;
+}
 
-	char sendSegment[MAX_SEG_SIZE]={0};
-	char recvSegment[MAX_SEG_SIZE];
+void ReliableSocket::answer_syn(char segment[MAX_SEG_SIZE],
+		const struct sockaddr_storage &from) {
+	RDTHeader *hdr = (RDTHeader*)segment;
+	RDTHandshake *syn_opts = (RDTHandshake*)(hdr+1);
 
-	hdr = (RDTHeader*) sendSegment;
-	hdr->ack_number = htonl(0); //set ack number for initalizing handshake
-	hdr->sequence_number = htonl(0); //set sequence number
-	hdr->type = RDT_SYNACK;	
+	uint32_t isn;
+	if (!crypto_random(&isn, sizeof(isn))) {
+		return; // dropped, as if it was lost
+	}
 
-	while(1){
-		set_timeout_length(this->estimated_rtt + (4* this->dev_rtt));
-		this->send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader));
+	// Agree to whichever of the requested options we also want. (The segment
+	// was zeroed, so a SYN without options reads as asking for none.) The
+	// cookie takes the place of our nonce.
+	char sendSegment[MAX_SEG_SIZE]={0};
+	RDTHeader *synack = (RDTHeader*)sendSegment;
+	synack->ack_number = hdr->sequence_number; //acknowledge their ISN
+	synack->sequence_number = htonl(isn); //our ISN
+	synack->type = RDT_SYNACK;
+	RDTHandshake *synack_opts = (RDTHandshake*)(synack+1);
+	uint32_t options = this->agreed_options(ntohl(syn_opts->options));
+	synack_opts->options = htonl(options);
+	this->make_cookie(segment, isn, from, time(NULL) / COOKIE_LIFETIME,
+			synack_opts->nonce);
+	if (options & RDT_OPT_RESUME) {
+		synack_opts->resume_offset = htobe64(this->resume_offer_offset);
+		synack_opts->resume_hash = htobe64(this->resume_offer_hash);
+	}
 
-		hdr = (RDTHeader*) recvSegment;
+	// Answered under the SYN's connection ID. Nothing is kept, not even
+	// that: the connection only takes it on from a valid cookie echo.
+	synack->connection_id = hdr->connection_id;
+	int synack_len = this->sign_handshake(sendSegment);
+	if (this->send_segment(sendSegment, synack_len, &from) < 0) {
+		perror("synack send error");
+	}
+}
 
-		if(hdr->type == RDT_ACK){
-			break;
-		}
-		else if (hdr->type == RDT_DATA){
-			break;
-		}
-		else{
-			continue; //didn't reccieve ack or data
+bool ReliableSocket::accept_cookie(char segment[MAX_SEG_SIZE],
+		const struct sockaddr_storage &from) {
+	if (this->have_psk
+			&& !this->handshake_valid(segment, sizeof(RDTHeader) + sizeof(RDTCookieEcho))) {
+		return false;
+	}
+	RDTHeader *hdr = (RDTHeader*)segment;
+	RDTCookieEcho *echo = (RDTCookieEcho*)(hdr+1);
+
+	// A cookie is good for the rest of its time slot and the next one, so
+	// it must match the one we would make in either
+	uint32_t isn = ntohl(hdr->ack_number);
+	uint64_t slot = time(NULL) / COOKIE_LIFETIME;
+	uint8_t cookie[sizeof(echo->cookie)];
+	this->make_cookie(segment, isn, from, slot, cookie);
+	if (!crypto_equal(cookie, echo->cookie, sizeof(cookie))) {
+		this->make_cookie(segment, isn, from, slot - 1, cookie);
+		if (!crypto_equal(cookie, echo->cookie, sizeof(cookie))) {
+			return false;
 		}
+	}
 
+	/*
+	 * The socket isn't connected to the remote host, whose address may
+	 * change: segments are matched to the connection by the ID the SYN
+	 * carried (see recv_segment).
+	 */
+	this->connection_id = ntohl(hdr->connection_id);
+	this->peer_addr = from;
+	this->last_heard = current_msec();
+	this->options = this->agreed_options(ntohl(echo->syn.options));
+	this->resume_pending = (this->options & RDT_OPT_RESUME);
+	this->sequence_number = isn;
+	this->expected_sequence_number = ntohl(hdr->sequence_number);
+	if (this->have_psk) {
+		// Everything after the handshake is encrypted with keys derived
+		// from both nonces.
+		this->crypto = crypto_session_new(this->psk, echo->syn.nonce,
+				echo->cookie, false);
+		if (this->crypto == NULL) {
+			return false; // dropped; the initiator will echo again
+		}
 	}
+	return true;
+}
 
-	this->state = ESTABLISHED;
-	cerr << "INFO: Connection ESTABLISHED\n";
+void ReliableSocket::make_cookie(const char *segment, uint32_t isn,
+		const struct sockaddr_storage &from, uint64_t slot, uint8_t cookie[16]) {
+	// A MAC of everything the connection is set up from
+	const RDTHeader *hdr = (const RDTHeader*)segment;
+	struct {
+		uint64_t slot;
+		uint32_t isn;
+		uint32_t peer_isn;
+		uint32_t connection_id;
+		RDTHandshake syn;
+		char peer[64];
+	} input;
+	memset(&input, 0, sizeof(input));
+	input.slot = slot;
+	input.isn = isn;
+	input.peer_isn = hdr->sequence_number;
+	input.connection_id = hdr->connection_id;
+	memcpy(&input.syn, hdr+1, sizeof(RDTHandshake));
+	strncpy(input.peer, addr_to_string(from).c_str(), sizeof(input.peer) - 1);
+	crypto_handshake_tag(this->cookie_secret, &input, sizeof(input), cookie);
 }
 
-void ReliableSocket::connect_to_remote(char *hostname, int port_num) {
+bool ReliableSocket::connect_to_remote(const char *hostname, int port_num) {
+	if (this->state == FAILED) {
+		return false;
+	}
 	if (this->state != INIT) {
 		cerr << "Cannot call connect_to_remote on used socket\n";
-		return;
+		return false;
+	}
+	// Nothing heard yet: the idle timeout runs from now
+	this->last_heard = current_msec();
+
+	// Look up the addresses to try
+	std::vector<struct sockaddr_storage> candidates;
+	int resolve_error = addr_resolve(hostname, port_num, this->family, candidates);
+	if (resolve_error != 0) {
+		cerr << "ERROR: Can't resolve " << hostname << ": "
+			<< gai_strerror(resolve_error) << "\n";
+		this->fail(EHOSTUNREACH);
+		return false;
 	}
-
-	// set up IPv4 address info with given hostname and port number
-	struct sockaddr_in addr; 
-	addr.sin_family = AF_INET; 	// use IPv4
-	addr.sin_addr.s_addr = inet_addr(hostname);
-	addr.sin_port = htons(port_num); 
 
 	/*
-	 * UDP isn't connection-oriented, but calling connect here allows us to
-	 * remember the remote host (stored in fromaddr).
-	 * This means we can then use send and recv instead of the more complex
-	 * sendto and recvfrom.
+	 * The socket isn't connected to the remote host, since either end's
+	 * address may change: segments are matched to the connection by an ID
+	 * we pick (see recv_segment).
 	 */
-	if(connect(this->sock_fd, (struct sockaddr*)&addr, sizeof(addr))) {
-		perror("connect");
+	uint32_t isn;
+	if (!seq_random_isn(&isn)) {
+		this->fail(EIO);
+		return false;
 	}
+	this->sequence_number = isn;
+	do {
+		if (!crypto_random((uint8_t*)&this->connection_id, sizeof(this->connection_id))) {
+			this->fail(EIO);
+			return false;
+		}
+	} while (this->connection_id == 0);
 
 
 	//implement a handshaking protocol for the
@@ -166,28 +338,79 @@ void ReliableSocket::connect_to_remote(char *hostname, int port_num) {
 
 	RDTHeader* hdr = (RDTHeader*)sendSegment;
 	hdr->ack_number = htonl(0); //set ack number for initalizing handshake
-	hdr->sequence_number = htonl(0); //set sequence number
+	hdr->sequence_number = htonl((uint32_t)this->sequence_number); //our ISN
 	hdr->type = RDT_SYN;	
+	RDTHandshake *syn_opts = (RDTHandshake*)(hdr+1);
+	syn_opts->options = htonl(this->offered_options());
+	if (!crypto_random(syn_opts->nonce, sizeof(syn_opts->nonce))) {
+		this->fail(EIO);
+		return false;
+	}
+	int syn_len = this->sign_handshake(sendSegment);
 
-	this->set_timeout_length(this->estimated_rtt + (4* this->dev_rtt));
-	this->send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader));
-	//clear hdr
-	memset(hdr,0,sizeof(RDTHeader));
+	if (!this->race_syn(sendSegment, syn_len, candidates, recvSegment)) {
+		return false;
+	}
 	hdr = (RDTHeader*)recvSegment;
-	if (hdr->type != RDT_SYNACK) {
-		perror("Not a SYNACK");
+	this->expected_sequence_number = ntohl(hdr->sequence_number);
+	// Use only the options the listener agreed to
+	RDTHandshake *synack_opts = (RDTHandshake*)(hdr+1);
+	this->options = ntohl(synack_opts->options);
+	if (this->options & RDT_OPT_RESUME) {
+		this->resume_offer_offset = be64toh(synack_opts->resume_offset);
+		this->resume_offer_hash = be64toh(synack_opts->resume_hash);
 	}
 
-	memset(sendSegment,0,sizeof(RDTHeader));
-	hdr = (RDTHeader*)sendSegment;
-	hdr->ack_number = htonl(0);
-	hdr->sequence_number = htonl(0);
-	hdr->type = RDT_ACK;
-	this->send_timeout(sendSegment);
+	if (this->have_psk) {
+		if (!(this->options & RDT_OPT_ENCRYPT)) {
+			cerr << "ERROR: Remote host did not agree to encryption.\n";
+			this->fail(EPROTO);
+			return false;
+		}
+		this->crypto = crypto_session_new(this->psk, syn_opts->nonce,
+				synack_opts->nonce, true);
+		if (this->crypto == NULL) {
+			this->fail(EIO);
+			return false;
+		}
+	}
 
+	// Echo the listener's cookie along with our SYN's payload. The listener
+	// keeps nothing for us until it has this, so it is resent until the
+	// listener answers. Only its ACK of the echo, or its first data, shows
+	// that it has set the connection up (if that is data, it will be
+	// resent). Both are encrypted if we share a key, and either way they
+	// must carry the ISNs we just agreed on, so a stray SYN, SYNACK or
+	// echo, which anyone could send, doesn't count.
+	RDTCookieEcho echo;
+	memcpy(&echo.syn, syn_opts, sizeof(RDTHandshake));
+	memcpy(echo.cookie, synack_opts->nonce, sizeof(echo.cookie));
+	memset(sendSegment, 0, MAX_SEG_SIZE);
+	hdr = (RDTHeader*)sendSegment;
+	hdr->ack_number = htonl((uint32_t)this->expected_sequence_number);
+	hdr->sequence_number = htonl((uint32_t)this->sequence_number);
+	hdr->type = RDT_COOKIE_ECHO;
+	memcpy(hdr+1, &echo, sizeof(echo));
+	int echo_len = this->sign_handshake(sendSegment, sizeof(RDTHeader) + sizeof(echo));
+	while (1) {
+		if (!this->send_seg_reliable(sendSegment, recvSegment, echo_len)) {
+			return false;
+		}
+		RDTHeader *answer = (RDTHeader*)recvSegment;
+		if (answer->type == RDT_ACK
+				&& ntohl(answer->ack_number) == (uint32_t)this->sequence_number
+				&& ntohl(answer->sequence_number) == (uint32_t)this->expected_sequence_number) {
+			break;
+		}
+		if ((answer->type == RDT_DATA || answer->type == RDT_PARITY || answer->type == RDT_SKIP)
+				&& ntohl(answer->sequence_number) == (uint32_t)this->expected_sequence_number) {
+			break;
+		}
+	}
 
 	this->state = ESTABLISHED;
 	cerr << "INFO: Connection ESTABLISHED\n";
+	return true;
 }
 
 
@@ -207,91 +430,1047 @@ void ReliableSocket::set_estimated_rtt() {
 		deviation = deviation * -1;
 	}	
 	this->dev_rtt = dev_rtt + (deviation *.25);
+	if (this->dev_rtt < 1) {
+		// A zero timeout means wait forever, which a lost segment turns
+		// into a hang on fast links where the RTT rounds down to 0 ms.
+		this->dev_rtt = 1;
+	}
+
+	this->set_timeout_length(this->estimated_rtt + (4 * this->dev_rtt)); 
+}
+
+void ReliableSocket::set_compression(bool enable) {
+	if (this->state != INIT) {
+		cerr << "ERROR: Compression must be set before connecting\n";
+		return;
+	}
+	this->compression_enabled = enable;
+}
+
+uint32_t ReliableSocket::offered_options() {
+	uint32_t offered = 0;
+	if (this->compression_enabled) {
+		offered |= RDT_OPT_COMPRESS;
+	}
+	if (this->have_psk) {
+		offered |= RDT_OPT_ENCRYPT;
+	}
+	// We can always take up an offer to resume; a listener only makes one
+	// if it was given an offer to make.
+	offered |= RDT_OPT_RESUME;
+	return offered;
+}
+
+uint32_t ReliableSocket::agreed_options(uint32_t requested) {
+	uint32_t agreed = requested & this->offered_options();
+	if (this->resume_offer_offset == 0) {
+		agreed &= ~RDT_OPT_RESUME; // nothing to offer
+	}
+	return agreed;
+}
+
+void ReliableSocket::set_psk(const uint8_t key[CRYPTO_KEY_SIZE]) {
+	if (this->state != INIT) {
+		cerr << "ERROR: The pre-shared key must be set before connecting\n";
+		return;
+	}
+	memcpy(this->psk, key, CRYPTO_KEY_SIZE);
+	this->have_psk = true;
+}
+
+int ReliableSocket::sign_handshake(char segment[MAX_SEG_SIZE], int length) {
+	if (!this->have_psk) {
+		return length;
+	}
+	// The tag covers the connection ID, which send_segment would stamp
+	RDTHeader *hdr = (RDTHeader*)segment;
+	if (hdr->connection_id == 0) {
+		hdr->connection_id = htonl(this->connection_id);
+	}
+	crypto_handshake_tag(this->psk, segment, length, (uint8_t*)segment + length);
+	return length + CRYPTO_TAG_SIZE;
+}
+
+bool ReliableSocket::handshake_valid(char segment[MAX_SEG_SIZE], int length) {
+	return crypto_handshake_verify(this->psk, segment, length,
+			(uint8_t*)segment + length);
+}
+
+int ReliableSocket::max_payload() {
+	return MAX_DATA_SIZE - (this->crypto != NULL ? CRYPTO_OVERHEAD : 0);
+}
+
+int ReliableSocket::send_segment(const char *segment, int length,
+		const struct sockaddr_storage *to) {
+	this->last_sent = current_msec();
+	if (to == NULL) {
+		to = &this->peer_addr;
+	}
+	RDTHeader header;
+	memcpy(&header, segment, sizeof(RDTHeader));
+	if (header.connection_id == 0) {
+		header.connection_id = htonl(this->connection_id);
+	}
+
+	// The header is stamped in a copy, and the payload sent from where it
+	// is. Handshake segments carry their own signature instead of being
+	// encrypted.
+	struct iovec iov[2];
+	int iovcnt = 2;
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(RDTHeader);
+	iov[1].iov_base = (void*)(segment + sizeof(RDTHeader));
+	iov[1].iov_len = length - sizeof(RDTHeader);
+	char sealed[MAX_SEG_SIZE];
+	if (this->crypto != NULL && header.type != RDT_SYN && header.type != RDT_SYNACK
+			&& header.type != RDT_COOKIE_ECHO) {
+		memcpy(sealed, &header, sizeof(RDTHeader));
+		memcpy(sealed + sizeof(RDTHeader), segment + sizeof(RDTHeader),
+				length - sizeof(RDTHeader));
+		iov[0].iov_base = sealed;
+		iov[0].iov_len = crypto_seal(this->crypto, sealed, sizeof(RDTHeader), length);
+		iovcnt = 1;
+	}
+
+	if (header.type == RDT_DATA || header.type == RDT_PARITY) {
+		this->pace(iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0));
+	}
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = (void*)to;
+	msg.msg_namelen = addr_length(*to);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	return sendmsg(this->sock_fd, &msg, 0);
+}
+
+void ReliableSocket::pace(int length) {
+	int64_t wait = rate_take(global_rate_limit, length);
+	if (this->rate_limit != NULL) {
+		wait = std::max(wait, rate_take(this->rate_limit, length));
+	}
+	if (wait > 0) {
+		struct timespec delay = { (time_t)(wait / 1000000000), (long)(wait % 1000000000) };
+		nanosleep(&delay, NULL);
+	}
+}
+
+int ReliableSocket::recv_segment(char segment[MAX_SEG_SIZE],
+		struct sockaddr_storage *from_addr) {
+	int deadline = current_msec() + this->timeout_length;
+	bool first = true;
+	while (1) {
+		// After a segment is dropped, only wait out what is left of the
+		// timeout
+		if (!first && this->timeout_length > 0) {
+			struct pollfd ready = { this->sock_fd, POLLIN, 0 };
+			int remaining = deadline - current_msec();
+			if (remaining <= 0 || poll(&ready, 1, remaining) == 0) {
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+		first = false;
+
+		struct sockaddr_storage from;
+		socklen_t from_len = sizeof(from);
+		int length = recvfrom(this->sock_fd, segment, MAX_SEG_SIZE, 0,
+				(struct sockaddr*)&from, &from_len);
+		if (length < 0) {
+			return length;
+		}
+		RDTHeader *hdr = (RDTHeader*)segment;
+		if (length < (int)sizeof(RDTHeader)
+				|| ntohl(hdr->connection_id) != this->connection_id) {
+			// Dropped quietly, so a flood of them costs as little as it can
+			continue;
+		}
+		RDTMessageType type = hdr->type;
+		if (this->crypto != NULL && type != RDT_SYN && type != RDT_SYNACK
+				&& type != RDT_COOKIE_ECHO) {
+			int plain_len = crypto_open(this->crypto, segment, sizeof(RDTHeader), length);
+			if (plain_len < 0) {
+				cerr << "INFO: Dropping segment that failed authentication\n";
+				continue;
+			}
+			// Leave the buffer looking like a plaintext segment was received
+			memset(segment + plain_len, 0, length - plain_len);
+			length = plain_len;
+		}
+		this->last_heard = current_msec();
+		if (this->check_path(segment, length, from)) {
+			if (from_addr != NULL) {
+				*from_addr = from;
+			}
+			return length;
+		}
+	}
+}
+
+bool ReliableSocket::race_syn(const char *syn, int syn_len,
+		const std::vector<struct sockaddr_storage> &candidates,
+		char recvSegment[MAX_SEG_SIZE]) {
+	std::vector<int> sent_at(candidates.size(), 0);
+	std::vector<bool> unreachable(candidates.size(), false);
+	size_t tried = 0;
+	size_t failed = 0;
+	int next_attempt = current_msec();
+	uint32_t timeout = this->estimated_rtt + (4*this->dev_rtt);
+	int next_resend = next_attempt + timeout;
+
+	while (1) {
+		int now = current_msec();
+		if (tried < candidates.size() && now - next_attempt >= 0) {
+			cerr << "INFO: Trying " << addr_to_string(candidates[tried]) << "\n";
+			sent_at[tried] = now;
+			if (this->send_segment(syn, syn_len, &candidates[tried]) < 0) {
+				// Unreachable from here (e.g. no IPv6 route): next one now
+				cerr << "INFO: Can't send to " << addr_to_string(candidates[tried])
+					<< ": " << strerror(errno) << "\n";
+				unreachable[tried] = true;
+				if (++failed == candidates.size()) {
+					this->fail(errno); // none of them can be reached
+					return false;
+				}
+			}
+			else {
+				next_attempt = now + CONNECT_ATTEMPT_DELAY;
+			}
+			tried++;
+			continue;
+		}
+		if (now - next_resend >= 0) {
+			cerr << "TIMEOUT. DOUBLING THE LENGTH OF TIMEOUT\n";
+			for (size_t i = 0; i < tried; i++) {
+				if (!unreachable[i]) {
+					sent_at[i] = now;
+					this->send_segment(syn, syn_len, &candidates[i]);
+				}
+			}
+			timeout *= 2;
+			next_resend = now + timeout;
+			continue;
+		}
+
+		int wait = next_resend - now;
+		if (tried < candidates.size()) {
+			wait = std::min(wait, next_attempt - now);
+		}
+		this->set_timeout_length(this->cap_wait(std::max(wait, 1)));
+		struct sockaddr_storage from;
+		memset(recvSegment, 0, MAX_SEG_SIZE);
+		if (this->recv_segment(recvSegment, &from) < 0) {
+			if (errno == EAGAIN) {
+				if (!this->peer_alive()) {
+					return false;
+				}
+				continue;
+			}
+			this->fail(errno);
+			return false;
+		}
+
+		// Only a SYNACK for this SYN will do (and with a pre-shared key,
+		// only one signed with it).
+		RDTHeader *hdr = (RDTHeader*)recvSegment;
+		if (hdr->type != RDT_SYNACK
+				|| ntohl(hdr->ack_number) != (uint32_t)this->sequence_number
+				|| (this->have_psk && !this->handshake_valid(recvSegment))) {
+			cerr << "INFO: Ignoring segment that isn't a SYNACK for our SYN\n";
+			continue;
+		}
+		int sent = *std::max_element(sent_at.begin(), sent_at.begin() + tried);
+		for (size_t i = 0; i < tried; i++) {
+			if (addr_equal(from, candidates[i])) {
+				sent = sent_at[i];
+			}
+		}
+		this->current_rtt = current_msec() - sent;
+		this->set_estimated_rtt();
+		this->peer_addr = from;
+		cerr << "INFO: Connected to " << addr_to_string(from) << "\n";
+		return true;
+	}
+}
+
+bool ReliableSocket::check_path(char segment[MAX_SEG_SIZE], int length,
+		const struct sockaddr_storage &from) {
+	RDTHeader *hdr = (RDTHeader*)segment;
+	if (hdr->type == RDT_PATH_CHALLENGE) {
+		// Echo it back the way it came, showing we are at this address
+		hdr->type = RDT_PATH_RESPONSE;
+		if (this->send_segment(segment, length, &from) < 0) {
+			perror("path response send error");
+		}
+		return false;
+	}
+	if (hdr->type == RDT_PATH_RESPONSE) {
+		if (this->challenge_pending && addr_equal(from, this->challenge_addr)
+				&& length == (int)(sizeof(RDTHeader) + sizeof(this->challenge_data))
+				&& memcmp(hdr+1, this->challenge_data, sizeof(this->challenge_data)) == 0) {
+			cerr << "INFO: Remote host moved to " << addr_to_string(from) << "\n";
+			this->peer_addr = from;
+			this->challenge_pending = false;
+		}
+		return false;
+	}
+	// Handshake segments don't count: with happy eyeballs, a SYN to
+	// another of our addresses may turn up after the connection is set up
+	if ((this->state != ESTABLISHED && this->state != FIN)
+			|| hdr->type == RDT_SYN || hdr->type == RDT_SYNACK
+			|| hdr->type == RDT_COOKIE_ECHO
+			|| addr_equal(from, this->peer_addr)) {
+		return true;
+	}
+
+	// Challenge the new address, again if a challenge seems to be lost
+	int now = current_msec();
+	if (!this->challenge_pending || !addr_equal(from, this->challenge_addr)
+			|| now - this->challenge_sent >= this->estimated_rtt + 4*this->dev_rtt) {
+		char challenge[sizeof(RDTHeader) + sizeof(this->challenge_data)] = {0};
+		if ((!this->challenge_pending || !addr_equal(from, this->challenge_addr))
+				&& !crypto_random(this->challenge_data, sizeof(this->challenge_data))) {
+			return false; // can't challenge it, so dropped
+		}
+		hdr = (RDTHeader*)challenge;
+		hdr->type = RDT_PATH_CHALLENGE;
+		memcpy(hdr+1, this->challenge_data, sizeof(this->challenge_data));
+		cerr << "INFO: Segment from new address " << addr_to_string(from)
+			<< ", validating it\n";
+		if (this->send_segment(challenge, sizeof(challenge), &from) < 0) {
+			perror("path challenge send error");
+		}
+		this->challenge_pending = true;
+		this->challenge_addr = from;
+		this->challenge_sent = now;
+	}
+	return true;
+}
+
+void ReliableSocket::set_fec_group_size(int group_size) {
+	if (group_size == FEC_AUTO) {
+		this->fec_auto = true;
+		return; // group size is picked when the next group starts
+	}
+	if (group_size != 0 && (group_size < 2 || group_size > MAX_FEC_GROUP)) {
+		cerr << "ERROR: FEC group size must be 0 or between 2 and "
+			<< MAX_FEC_GROUP << "\n";
+		return;
+	}
+	// Don't strand a partially filled group when FEC is turned off.
+	if (group_size == 0 && !this->fec_pending.empty()) {
+		this->send_fec_group();
+	}
+	this->fec_auto = false;
+	this->fec_group_size = group_size;
+}
+
+double ReliableSocket::get_loss_rate() {
+	return this->loss_rate;
+}
+
+void ReliableSocket::set_resume_offer(uint64_t offset, uint64_t hash) {
+	if (this->state != INIT) {
+		cerr << "ERROR: A resume offer must be set before connecting\n";
+		return;
+	}
+	this->resume_offer_offset = offset;
+	this->resume_offer_hash = hash;
+}
+
+uint64_t ReliableSocket::get_resume_offset() {
+	return this->resume_offset;
+}
+
+bool ReliableSocket::get_resume_offer(uint64_t *offset, uint64_t *hash) {
+	if (!(this->options & RDT_OPT_RESUME)) {
+		return false;
+	}
+	*offset = this->resume_offer_offset;
+	*hash = this->resume_offer_hash;
+	return true;
+}
+
+void ReliableSocket::resume() {
+	if (this->state != ESTABLISHED || !(this->options & RDT_OPT_RESUME)) {
+		cerr << "ERROR: No resume offer to accept\n";
+		return;
+	}
+	// Like a SYN in TCP, accepting takes up one sequence number, so the
+	// listener can tell from the first data segment whether we accepted.
+	// An empty segment makes sure there is one.
+	this->sequence_number++;
+	this->send_stop_and_wait(NULL, 0);
+}
+
+void ReliableSocket::check_resume(uint64_t seq) {
+	this->resume_pending = false;
+	if (seq == this->expected_sequence_number + 1) {
+		this->expected_sequence_number++;
+		this->resume_offset = this->resume_offer_offset;
+		cerr << "INFO: Sender resumed at byte " << this->resume_offset << "\n";
+	}
+	else {
+		cerr << "INFO: Sender declined to resume\n";
+	}
+}
+
+void ReliableSocket::record_loss(int sent, int lost) {
+	// Exponentially weighted like the RTT estimate, one step per segment, so
+	// the estimate reflects roughly the last few dozen transmissions.
+	const double alpha = 1.0 / 32;
+	for (int i = 0; i < sent; i++) {
+		double sample = (i < lost) ? 1 : 0;
+		this->loss_rate += alpha * (sample - this->loss_rate);
+	}
+}
+
+// You shouldn't need to modify this function in any way.
+void ReliableSocket::set_timeout_length(uint32_t timeout_length_ms) {
+	cerr << "INFO: Setting timeout to " << timeout_length_ms << " ms\n";
+	this->timeout_length = timeout_length_ms;
+	struct timeval timeout;
+	msec_to_timeval(timeout_length_ms, &timeout);
+
+	if (setsockopt(this->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+				sizeof(struct timeval)) < 0) {
+		this->fail(errno);
+	}
+}
+
+bool ReliableSocket::send_data(const void *data, int length) {
+	if (this->state != ESTABLISHED) {
+		cerr << "INFO: Cannot send: Connection not established.\n";
+		return false;
+	}
+
+	if (length > 0 && this->corked && !this->cork_pending) {
+		this->cork_pending = true;
+		this->cork_start = current_msec();
+	}
+
+	if (this->options & RDT_OPT_COMPRESS) {
+		// The compressor already packs its output into full segments
+		this->deflate_and_send(data, length, Z_NO_FLUSH);
+	}
+	else if (this->corked) {
+		// Send whole segments' worth and keep the remainder for later
+		const char *bytes = (const char*)data;
+		this->cork_buffer.insert(this->cork_buffer.end(), bytes, bytes + length);
+		int full = this->cork_buffer.size()
+			- this->cork_buffer.size() % this->max_payload();
+		this->send_segments(this->cork_buffer.data(), full);
+		this->cork_buffer.erase(this->cork_buffer.begin(),
+				this->cork_buffer.begin() + full);
+	}
+	else {
+		this->send_segments((const char*)data, length);
+	}
+
+	if (this->cork_pending && current_msec() - this->cork_start >= CORK_DELAY) {
+		this->flush();
+	}
+	return this->state == ESTABLISHED;
+}
+
+void ReliableSocket::send_segments(const char *data, int length) {
+	// Encryption takes some room from each segment, so a full
+	// MAX_DATA_SIZE buffer may need to be split.
+	while (length > 0) {
+		int chunk = std::min(length, this->max_payload());
+		this->send_payload(data, chunk);
+		data += chunk;
+		length -= chunk;
+	}
+}
+
+void ReliableSocket::set_cork(bool enable) {
+	this->corked = enable;
+	if (!enable) {
+		this->flush();
+	}
+}
+
+void ReliableSocket::flush() {
+	if (this->state != ESTABLISHED) {
+		return;
+	}
+	if (!this->cork_buffer.empty()) {
+		this->send_segments(this->cork_buffer.data(), this->cork_buffer.size());
+		this->cork_buffer.clear();
+	}
+	if (this->deflater != NULL) {
+		this->deflate_and_send(NULL, 0, Z_SYNC_FLUSH);
+	}
+	if (!this->fec_pending.empty()) {
+		this->send_fec_group();
+	}
+	this->cork_pending = false;
+}
+
+bool ReliableSocket::send_payload(const void *data, int length) {
+	if (this->state != ESTABLISHED) {
+		return false; // timed out
+	}
+	if (this->fec_auto && this->fec_pending.empty()) {
+		int group_size = fec_choose_group_size(this->loss_rate,
+				this->fec_group_size, MAX_FEC_GROUP);
+		if (group_size != this->fec_group_size) {
+			cerr << "INFO: Loss rate " << this->loss_rate
+				<< ", FEC group size now " << group_size << "\n";
+			this->fec_group_size = group_size;
+		}
+	}
+
+	if (this->fec_group_size > 0) {
+		// Hold on to the payload until we have a full group to protect.
+		const char *bytes = (const char*)data;
+		this->fec_pending.push_back(std::vector<char>(bytes, bytes + length));
+		if ((int)this->fec_pending.size() >= this->fec_group_size) {
+			return this->send_fec_group();
+		}
+		return true;
+	}
+	return this->send_stop_and_wait(data, length);
+}
+
+bool ReliableSocket::send_stop_and_wait(const void *data, int length) {
+	// Create the segment, which contains a header followed by the data.
+	char sendSegment[MAX_SEG_SIZE]={0};
+	char recvSegment[MAX_SEG_SIZE];
+
+	// Fill in the header
+	RDTHeader *hdr = (RDTHeader*)sendSegment;
+	hdr->sequence_number = htonl((uint32_t)this->sequence_number);
+	hdr->ack_number = htonl(0);
+	hdr->type = RDT_DATA;
+
+	// Copy the user-supplied data to the spot right past the 
+	// 	header (i.e. hdr+1).
+	if (length > 0) {
+		memcpy(hdr+1, data, length);
+	}
+
+
+	// waits for an acknowledgment of the data you just sent, and keeps
+	// resending until that ack comes.
+	// Utilize the set_timeout_length function to make sure you timeout after
+	// a certain amount of waiting (so you can try sending again).
+
+	while(1) {
+		if (this->give_up(false)) {
+			return false;
+		}
+		memset(recvSegment,0,MAX_SEG_SIZE);
+		if (!this->send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader) + length)) {
+			return false;
+		}
+
+		hdr = (RDTHeader*)recvSegment;
+		if (hdr->type == RDT_ACK) {
+			// ACKs carry the next byte the receiver expects
+			uint64_t acked = seq_unwrap(ntohl(hdr->ack_number), this->sequence_number);
+			if (seq_compare(acked, this->sequence_number + length) >= 0) {
+				break; // Recieved desired ACK
+			}
+			else {
+				continue; // Out of order ACK
+			}	
+		}
+		else{
+			this->answer_stray(recvSegment);
+			continue; // No ACK so loop again
+		} 
+	}
+	this->sequence_number += length;
+	return true;
+}
+
+void ReliableSocket::answer_stray(char segment[MAX_SEG_SIZE]) {
+	RDTHeader *hdr = (RDTHeader*)segment;
+	if (hdr->type == RDT_KEEPALIVE) {
+		if (hdr->ack_number == 0) {
+			this->send_keepalive(true); // a probe rather than an answer
+		}
+		return;
+	}
+	if (hdr->type == RDT_COOKIE_ECHO) {
+		// Repeated because our answer to it was lost
+	}
+	else if (hdr->type == RDT_DATA && fec_info_group_size(ntohl(hdr->ack_number)) == 0
+			&& seq_compare(seq_unwrap(ntohl(hdr->sequence_number),
+					this->expected_sequence_number), this->expected_sequence_number) < 0) {
+		// Repeated because our ACK was lost, just as we stopped receiving
+	}
+	else {
+		return;
+	}
+	char ackSegment[sizeof(RDTHeader)] = {0};
+	hdr = (RDTHeader*)ackSegment;
+	hdr->sequence_number = htonl((uint32_t)this->sequence_number);
+	hdr->ack_number = htonl((uint32_t)this->expected_sequence_number);
+	hdr->type = RDT_ACK;
+	if (this->send_segment(ackSegment, sizeof(RDTHeader)) < 0) {
+		perror("answer_stray send error");
+	}
+}
+
+
+int ReliableSocket::receive_data(char buffer[MAX_DATA_SIZE]) {
+	return this->receive(buffer, MAX_DATA_SIZE);
+}
+
+int ReliableSocket::receive(void *buffer, int capacity, int flags) {
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = capacity;
+	return this->receivev(&iov, 1, flags);
+}
+
+int ReliableSocket::receivev(const struct iovec *iov, int iovcnt, int flags) {
+	int total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		char *buffer = (char*)iov[i].iov_base;
+		int left = iov[i].iov_len;
+		while (left > 0) {
+			// Only the first byte is worth waiting for, unless asked to fill
+			// the buffers.
+			bool block = (total == 0 || (flags & RDT_WAITALL));
+			int received = this->receive_some(buffer, left, block);
+			if (received == 0) {
+				return total; // connection closed
+			}
+			if (received < 0) {
+				// Nothing more without waiting, or (if nothing was received
+				// at all, since the first byte is waited for) timed out
+				return (total == 0) ? -1 : total;
+			}
+			total += received;
+			buffer += received;
+			left -= received;
+		}
+	}
+	return total;
+}
+
+int ReliableSocket::receive_some(char *buffer, int capacity, bool block) {
+	if (!(this->options & RDT_OPT_COMPRESS)) {
+		if (this->ready_segments.empty() && !block) {
+			return -1;
+		}
+		if (this->ready_segments.empty()) {
+			int offset;
+			int length = this->receive_payload(this->recv_scratch, &offset);
+			if (length < 0) {
+				return -1; // timed out
+			}
+			int copied = std::min(capacity, length);
+			memcpy(buffer, this->recv_scratch.data() + offset, copied);
+			if (copied < length) {
+				// The rest goes ahead of the rest of its FEC group (if any)
+				const char *rest = this->recv_scratch.data() + offset + copied;
+				this->ready_segments.push_front(
+						std::vector<char>(rest, rest + length - copied));
+			}
+			return copied;
+		}
+
+		// Hand out the front payload, keeping whatever doesn't fit
+		std::vector<char> &payload = this->ready_segments.front();
+		int copied = std::min(capacity, (int)payload.size());
+		memcpy(buffer, payload.data(), copied);
+		if (copied == (int)payload.size()) {
+			this->ready_segments.pop_front();
+		}
+		else {
+			payload.erase(payload.begin(), payload.begin() + copied);
+		}
+		return copied;
+	}
+
+	if (this->inflater == NULL) {
+		this->inflater = new z_stream();
+		if (inflateInit(this->inflater) != Z_OK) {
+			cerr << "ERROR: inflateInit failed\n";
+			this->fail(ENOMEM);
+			return -1;
+		}
+	}
+
+	// Decompress straight into the caller's buffer, pulling in another
+	// segment only once everything from the previous one has been returned.
+	// Only one segment of compressed input is held at a time, so memory use
+	// is bounded no matter how well the data compresses.
+	z_stream *strm = this->inflater;
+	while (1) {
+		if (strm->avail_in > 0 || this->inflate_more) {
+			strm->next_out = (Bytef*)buffer;
+			strm->avail_out = capacity;
+			int ret = inflate(strm, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				cerr << "ERROR: Corrupt compressed stream: "
+					<< (strm->msg ? strm->msg : "unknown") << "\n";
+				this->fail(EBADMSG);
+				return -1;
+			}
+			int produced = capacity - strm->avail_out;
+			// A full buffer means inflate may still be holding output
+			this->inflate_more = (strm->avail_out == 0);
+			if (produced > 0) {
+				return produced;
+			}
+		}
+
+		if (this->ready_segments.empty() && !block) {
+			return -1;
+		}
+		int offset;
+		int recv_size = this->receive_payload(this->inflate_in, &offset);
+		if (recv_size <= 0) {
+			return recv_size; // connection closed or timed out
+		}
+		strm->next_in = (Bytef*)this->inflate_in.data() + offset;
+		strm->avail_in = recv_size;
+	}
+}
+
+int ReliableSocket::borrow_buffer() {
+	std::lock_guard<std::mutex> lock(this->loan_mutex);
+	if (this->loan_free.empty()) {
+		this->loan_buffers.push_back(std::vector<char>());
+		this->loan_free.push_back(this->loan_buffers.size() - 1);
+	}
+	int id = this->loan_free.back();
+	this->loan_free.pop_back();
+	return id;
+}
+
+int ReliableSocket::receive_loan(RDTLoan *loan) {
+	int id = this->borrow_buffer();
+	// Releasing never moves loan_buffers, so this stays valid unlocked
+	std::vector<char> &buffer = this->loan_buffers[id];
+
+	int offset = 0;
+	int length;
+	if (this->options & RDT_OPT_COMPRESS) {
+		buffer.resize(MAX_SEG_SIZE);
+		length = this->receive_some(buffer.data(), MAX_SEG_SIZE, true);
+	}
+	else {
+		length = this->receive_payload(buffer, &offset);
+	}
+
+	if (length <= 0) {
+		std::lock_guard<std::mutex> lock(this->loan_mutex);
+		this->loan_free.push_back(id);
+		loan->data = NULL;
+		loan->length = 0;
+		loan->id = -1;
+		return length;
+	}
+	loan->data = buffer.data() + offset;
+	loan->length = length;
+	loan->id = id;
+	return length;
+}
+
+void ReliableSocket::release_loan(const RDTLoan &loan) {
+	if (loan.id < 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(this->loan_mutex);
+	this->loan_free.push_back(loan.id);
+}
+
+bool ReliableSocket::send_message(const void *data, int length, int lifetime_ms,
+		int max_retransmits) {
+	if (this->state != ESTABLISHED) {
+		cerr << "INFO: Cannot send: Connection not established.\n";
+		return false;
+	}
+	if (this->options & RDT_OPT_COMPRESS) {
+		cerr << "ERROR: Messages can't be sent on a compressed connection\n";
+		return false;
+	}
+
+	int room = this->max_payload() - 1;
+	bool limited = (lifetime_ms > 0 || max_retransmits >= 0);
+	uint64_t end = 0;
+	if (limited) {
+		// Earlier data stays fully reliable, and can't share an FEC group
+		// with a message that may be abandoned
+		this->send_fec_group();
+		int pieces = std::max((length + room - 1) / room, 1);
+		end = this->sequence_number + length + pieces;
+		this->send_has_deadline = (lifetime_ms > 0);
+		this->send_deadline = current_msec() + lifetime_ms;
+		this->send_retransmits_left = max_retransmits;
+	}
+
+	// Messages go out segment by segment, bypassing the cork, with a marker
+	// byte in front of each piece
+	const char *bytes = (const char*)data;
+	char payload[MAX_DATA_SIZE];
+	bool delivered = true;
+	do {
+		int chunk = std::min(length, room);
+		payload[0] = (chunk == length) ? MESSAGE_END : MESSAGE_MORE;
+		memcpy(payload + 1, bytes, chunk);
+		if (!this->send_payload(payload, chunk + 1)) {
+			delivered = false;
+			break;
+		}
+		bytes += chunk;
+		length -= chunk;
+	} while (length > 0);
+
+	if (!limited) {
+		return true;
+	}
+	if (delivered) {
+		delivered = this->send_fec_group(); // settle the last group now
+	}
+	this->send_has_deadline = false;
+	this->send_retransmits_left = -1;
+	if (!delivered && this->state == ESTABLISHED) {
+		cerr << "INFO: Gave up on a message, telling the receiver to skip it\n";
+		this->send_skip(end, 0); // send_message's messages are on stream 0
+	}
+	return delivered;
+}
+
+int ReliableSocket::receive_message(RDTLoan *loan, int *stream) {
+	loan->data = NULL;
+	loan->length = 0;
+	loan->id = -1;
+	if (this->options & RDT_OPT_COMPRESS) {
+		cerr << "ERROR: Messages can't be received on a compressed connection\n";
+		return -1;
+	}
+
+	int message_stream;
+	while (1) {
+		int id = this->borrow_buffer();
+		std::vector<char> &buffer = this->loan_buffers[id];
+		int offset;
+		int length = this->receive_payload(buffer, &offset);
+		// The sender gave up on a message, so what we have of it is stale.
+		// Messages on other streams are unaffected.
+		for (int skipped : this->skipped_streams) {
+			this->drop_partials(skipped);
+		}
+		this->skipped_streams.clear();
+		if (length <= 0) {
+			this->release_loan({NULL, 0, id});
+			this->drop_partials();
+			return -1;
+		}
+
+		char marker = buffer[offset];
+		int header = (marker & MESSAGE_STREAM) ? 3 : 1;
+		if (length < header) {
+			cerr << "INFO: Dropping malformed message segment\n";
+			this->release_loan({NULL, 0, id});
+			continue;
+		}
+		message_stream = 0;
+		if (marker & MESSAGE_STREAM) {
+			uint16_t stream_net;
+			memcpy(&stream_net, buffer.data() + offset + 1, 2);
+			message_stream = ntohs(stream_net);
+		}
+		const char *data = buffer.data() + offset + header;
+		int data_len = length - header;
+
+		auto partial = this->message_partials.find(message_stream);
+		if (partial == this->message_partials.end()) {
+			if (marker & MESSAGE_END) {
+				// The whole message, lent from where it was received
+				loan->data = data;
+				loan->length = data_len;
+				loan->id = id;
+				break;
+			}
+			// The start of a longer message, which the rest is appended to
+			buffer.resize(offset + length);
+			this->message_partials[message_stream] = {id, offset + header};
+			continue;
+		}
+
+		std::vector<char> &whole = this->loan_buffers[partial->second.id];
+		whole.insert(whole.end(), data, data + data_len);
+		this->release_loan({NULL, 0, id});
+		if (marker & MESSAGE_END) {
+			loan->data = whole.data() + partial->second.start;
+			loan->length = whole.size() - partial->second.start;
+			loan->id = partial->second.id;
+			this->message_partials.erase(partial);
+			break;
+		}
+	}
 
-	this->set_timeout_length(this->estimated_rtt + (4 * this->dev_rtt)); 
+	if (stream != NULL) {
+		*stream = message_stream;
+	}
+	return loan->length;
 }
 
-// You shouldn't need to modify this function in any way.
-void ReliableSocket::set_timeout_length(uint32_t timeout_length_ms) {
-	cerr << "INFO: Setting timeout to " << timeout_length_ms << " ms\n";
-	struct timeval timeout;
-	msec_to_timeval(timeout_length_ms, &timeout);
-
-	if (setsockopt(this->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-				sizeof(struct timeval)) < 0) {
-		perror("setsockopt");
-		exit(EXIT_FAILURE);
+void ReliableSocket::drop_partials(int stream) {
+	for (auto partial = this->message_partials.begin();
+			partial != this->message_partials.end(); ) {
+		if (stream >= 0 && partial->first != stream) {
+			partial++;
+			continue;
+		}
+		this->release_loan({NULL, 0, partial->second.id});
+		partial = this->message_partials.erase(partial);
 	}
 }
 
-void ReliableSocket::send_data(const void *data, int length) {
-	if (this->state != ESTABLISHED) {
-		cerr << "INFO: Cannot send: Connection not established.\n";
+void ReliableSocket::set_stream_priority(int stream, int priority, int weight) {
+	if (stream < 0 || stream > MAX_STREAM || weight < 1) {
+		cerr << "ERROR: Invalid stream or weight\n";
 		return;
 	}
+	std::lock_guard<std::mutex> lock(this->stream_mutex);
+	this->streams[stream].priority = priority;
+	this->streams[stream].weight = weight;
+}
 
-	// Create the segment, which contains a header followed by the data.
-	char sendSegment[MAX_SEG_SIZE]={0};
-	char recvSegment[MAX_SEG_SIZE];
-
-	// Fill in the header
-	RDTHeader *hdr = (RDTHeader*)sendSegment;
-	hdr->sequence_number = htonl(this->sequence_number);
-	hdr->ack_number = htonl(0);
-	hdr->type = RDT_DATA;
-
-	// Copy the user-supplied data to the spot right past the 
-	// 	header (i.e. hdr+1).
-	memcpy(hdr+1, data, length);
-
-
-	// waits for an acknowledgment of the data you just sent, and keeps
-	// resending until that ack comes.
-	// Utilize the set_timeout_length function to make sure you timeout after
-	// a certain amount of waiting (so you can try sending again).
+void ReliableSocket::queue_message(int stream, const void *data, int length) {
+	if (stream < 0 || stream > MAX_STREAM) {
+		cerr << "ERROR: Invalid stream\n";
+		return;
+	}
+	const char *bytes = (const char*)data;
+	std::lock_guard<std::mutex> lock(this->stream_mutex);
+	this->streams[stream].messages.push_back(std::vector<char>(bytes, bytes + length));
+}
 
-	while(1) {
-		memset(recvSegment,0,MAX_SEG_SIZE);
-		send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader) + length);
+int ReliableSocket::send_queued() {
+	if (this->state != ESTABLISHED) {
+		cerr << "INFO: Cannot send: Connection not established.\n";
+		return 0;
+	}
+	if (this->options & RDT_OPT_COMPRESS) {
+		cerr << "ERROR: Messages can't be sent on a compressed connection\n";
+		return 0;
+	}
 
-		hdr = (RDTHeader*)recvSegment;
-		if (hdr->type == RDT_ACK) {
-			if (this->sequence_number == ntohl(hdr->ack_number)) {
-				break; // Recieved desired ACK
+	int sent = 0;
+	char payload[MAX_DATA_SIZE];
+	int room = this->max_payload() - 3;
+	while (1) {
+		int length;
+		{
+			std::lock_guard<std::mutex> lock(this->stream_mutex);
+			int stream = this->next_stream();
+			if (stream < 0) {
+				break;
+			}
+			StreamQueue &queue = this->streams[stream];
+			std::vector<char> &message = queue.messages.front();
+			int chunk = std::min((int)(message.size() - queue.sent), room);
+			bool end = (queue.sent + chunk == message.size());
+			payload[0] = MESSAGE_STREAM | (end ? MESSAGE_END : MESSAGE_MORE);
+			uint16_t stream_net = htons(stream);
+			memcpy(payload + 1, &stream_net, 2);
+			memcpy(payload + 3, message.data() + queue.sent, chunk);
+			length = chunk + 3;
+			queue.sent += chunk;
+			queue.deficit -= length;
+			if (end) {
+				queue.messages.pop_front();
+				queue.sent = 0;
+				if (queue.messages.empty()) {
+					queue.deficit = 0; // credit isn't saved up while idle
+				}
+				sent++;
 			}
-			else {
-				continue; // Out of order ACK
-			}	
 		}
-		else{
-			continue; // No ACK so loop again
-		} 
+		// Sent unlocked, so queue_message never waits on the network
+		if (!this->send_payload(payload, length)) {
+			break; // timed out
+		}
 	}
-	sequence_number++;
+	this->flush();
+	return sent;
 }
 
+int ReliableSocket::next_stream() {
+	bool any = false;
+	int best = 0;
+	for (auto &entry : this->streams) {
+		if (!entry.second.messages.empty() && (!any || entry.second.priority > best)) {
+			best = entry.second.priority;
+			any = true;
+		}
+	}
+	if (!any) {
+		return -1;
+	}
+
+	// Deficit round robin: a stream keeps its turn while it has credit
+	// left, and each turn gives it weight segments' worth more. Credit
+	// can go negative, since segments are never split, and that debt is
+	// carried into its next turn.
+	auto eligible = [best](const StreamQueue &queue) {
+		return !queue.messages.empty() && queue.priority == best;
+	};
+	auto it = this->streams.find(this->drr_stream);
+	if (it != this->streams.end() && eligible(it->second) && it->second.deficit > 0) {
+		return it->first;
+	}
+	do {
+		if (it == this->streams.end() || ++it == this->streams.end()) {
+			it = this->streams.begin();
+		}
+	} while (!eligible(it->second));
+	it->second.deficit += it->second.weight * this->max_payload();
+	this->drr_stream = it->first;
+	return it->first;
+}
 
-int ReliableSocket::receive_data(char buffer[MAX_DATA_SIZE]) {
+int ReliableSocket::receive_payload(std::vector<char> &segment, int *offset) {
+	*offset = 0;
+	if (!this->ready_segments.empty()) {
+		// Segments from a completed FEC group are handed out one at a time,
+		// trading buffers rather than copying.
+		segment.swap(this->ready_segments.front());
+		this->ready_segments.pop_front();
+		return segment.size();
+	}
+	if (this->state == FAILED) {
+		return -1;
+	}
 	if (this->state != ESTABLISHED) {
 		cerr << "INFO: Cannot receive: Connection not established.\n";
 		return 0;
 	}
 	int recv_data_size = 0;
-	this->set_timeout_length(0);
+	this->set_timeout_length(this->cap_wait(0));
+	segment.resize(MAX_SEG_SIZE);
 	while(1) {
 		char sendSegment[sizeof(RDTHeader)]={0};
-		char recvSegment[MAX_SEG_SIZE];
+		char *recvSegment = segment.data();
 		memset(recvSegment,0,MAX_SEG_SIZE);
 
 		// Set up pointers to both the header (hdr) and data (data) portions of
 		// the received segment.
 		RDTHeader* hdr = (RDTHeader*)recvSegment;	
-		void *data = (void*)(recvSegment + sizeof(RDTHeader));
 
-		int recv_count = recv(this->sock_fd, recvSegment, MAX_SEG_SIZE, 0);
+		int recv_count = this->recv_segment(recvSegment);
+		if (recv_count < 0 && errno == EAGAIN) {
+			if (!this->peer_alive()) {
+				return -1;
+			}
+			this->set_timeout_length(this->cap_wait(0));
+			continue;
+		}
 		if (recv_count < 0) {
-			perror("receive_data recv");
-			exit(EXIT_FAILURE);
+			this->fail(errno);
+			return -1;
 		}
 
 		// acknowledment that you
@@ -305,64 +1484,138 @@ int ReliableSocket::receive_data(char buffer[MAX_DATA_SIZE]) {
 			<< ", type = " << hdr->type << "\n";
 		
 		uint32_t sequence_num = hdr->sequence_number;
+		uint64_t full_seq = seq_unwrap(ntohl(sequence_num), this->expected_sequence_number);
 
 		if (hdr->type == RDT_ACK) {
 			//let the ack timeout for the sender for the inital 3 way
 			//handshake
 			continue;	
 		}
+		if (hdr->type == RDT_COOKIE_ECHO || hdr->type == RDT_KEEPALIVE) {
+			this->answer_stray(recvSegment);
+			continue;
+		}
+		if (hdr->type == RDT_SKIP) {
+			// The sender gave up on a message: carry on from its end,
+			// dropping whatever we hold of it
+			if (seq_compare(full_seq, this->expected_sequence_number) > 0) {
+				this->expected_sequence_number = full_seq;
+				this->fec_recv_size = 0;
+				uint32_t stream = ntohl(hdr->ack_number);
+				if (stream <= MAX_STREAM) {
+					this->skipped_streams.insert(stream);
+				}
+			}
+			hdr = (RDTHeader*)sendSegment;
+			hdr->sequence_number = htonl((uint32_t)this->sequence_number);
+			hdr->ack_number = htonl((uint32_t)this->expected_sequence_number);
+			hdr->type = RDT_ACK;
+			if (this->send_segment(sendSegment, sizeof(RDTHeader)) < 0) {
+				perror("receive_data send error");
+			}
+			continue;
+		}
+		if (this->resume_pending && (hdr->type == RDT_DATA || hdr->type == RDT_PARITY)) {
+			this->check_resume(full_seq);
+		}
+		if (hdr->type == RDT_PARITY || (hdr->type == RDT_DATA
+					&& fec_info_group_size(ntohl(hdr->ack_number)) > 0)) {
+			this->recv_fec_segment(recvSegment, recv_count);
+			if (this->ready_segments.empty()) {
+				continue; // group not complete yet
+			}
+			return this->receive_payload(segment, offset);
+		}
 		if (hdr->type == RDT_CLOSE) {
 			hdr = (RDTHeader*)sendSegment;
 			hdr->sequence_number = htonl(0);
 			hdr->ack_number = htonl(0);
-			hdr->type = RDT_ACK;
+			hdr->type = RDT_CLOSE_ACK;
 			
 			this->send_timeout(sendSegment);
 			
 			this->state = FIN;
 			break;	
 		}
-		else {
-			// ACK recieved packet
+		else if (hdr->type == RDT_DATA) {
+			// Sequence numbers count bytes and segment boundaries may change
+			// between transmissions, so the start of a segment may already
+			// have been delivered. skip is how much of it is old news.
+			int data_len = recv_count - sizeof(RDTHeader);
+			int64_t skip = seq_compare(this->expected_sequence_number, full_seq);
+			if (skip < 0) {
+				continue; // not sent yet as far as we know: stale or bogus
+			}
+			bool fresh = (skip < data_len);
+			if (fresh) {
+				this->expected_sequence_number = full_seq + data_len;
+			}
+
+			// ACK everything received so far
 			hdr = (RDTHeader*)sendSegment;
-			hdr->sequence_number = sequence_num;
-			hdr->ack_number = sequence_num;
+			hdr->sequence_number = htonl((uint32_t)this->sequence_number);
+			hdr->ack_number = htonl((uint32_t)this->expected_sequence_number);
 			hdr->type = RDT_ACK;
-			if (send(this->sock_fd, sendSegment, sizeof(RDTHeader), 0) < 0) {
+			if (this->send_segment(sendSegment, sizeof(RDTHeader)) < 0) {
 				perror("receive_data send error");	
 			}
-			if (ntohl(sequence_num) == this->sequence_number) {
-				// Got desired packet, end loop	
-			}
-			else {
-				continue; // Out of order sequence number, drop packet	
+			if (!fresh) {
+				continue; // duplicate, drop packet
 			}
+			// Got desired packet, end loop
+			recv_data_size = data_len - skip;
+			*offset = sizeof(RDTHeader) + skip;
+			break;
+		}
+		else {
+			continue; // nothing we need to handle here
 		}
-	this->sequence_number += 1;	
-	recv_data_size = recv_count - sizeof(RDTHeader);
-	memcpy(buffer, data, recv_data_size);
-	break;
 	}
 
 	return recv_data_size;
 }
 
 
-void ReliableSocket::close_connection() {
+bool ReliableSocket::close_connection() {
 	// Construct a RDT_CLOSE message to indicate to the remote host that we
 	// want to end this connection.
-	if(this->state != FIN){
+	if (this->state == ESTABLISHED && !this->cork_buffer.empty()) {
+		this->send_segments(this->cork_buffer.data(), this->cork_buffer.size());
+		this->cork_buffer.clear();
+	}
+	if (this->state == ESTABLISHED && this->deflater != NULL) {
+		this->deflate_and_send(NULL, 0, Z_FINISH); // flush the compressor
+	}
+	if (this->state == ESTABLISHED && !this->fec_pending.empty()) {
+		this->send_fec_group(); // flush the partially filled group
+	}
+	if (this->state == FAILED) {
+		// Nobody left to say goodbye to
+	}
+	else if(this->state != FIN){
 		this->send_close();
 	}
 	else {
 		this->recv_close();	
 	}
-	this->state = CLOSED;
+	bool clean = (this->state != FAILED);
+	if (clean) {
+		this->state = CLOSED;
+	}
+	this->end_compression();
+	crypto_session_free(this->crypto);
+	this->crypto = NULL;
+	rate_free(this->rate_limit);
+	this->rate_limit = NULL;
 
-	if (close(this->sock_fd) < 0) {
+	if (this->sock_fd >= 0 && close(this->sock_fd) < 0) {
 		perror("close_connection close");
 	}
-	cerr << "Connection Closed as Expected\n";
+	this->sock_fd = -1;
+	if (clean) {
+		cerr << "Connection Closed as Expected\n";
+	}
+	return clean;
 }
 
 void ReliableSocket::send_close() {
@@ -376,9 +1629,12 @@ void ReliableSocket::send_close() {
 	
 	while(1) {
 		//itilize close message
-		this->send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader));
+		if (!this->send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader))) {
+			return; // timed out
+		}
 		hdr = (RDTHeader*)recvSegment;
-		if (hdr->type == RDT_ACK) {
+		// Anything else, such as a late ACK of data, doesn't answer the close
+		if (hdr->type == RDT_CLOSE_ACK) {
 			break;	
 		}
 		//check if the ack was dropped if that is the case then the server is
@@ -389,14 +1645,19 @@ void ReliableSocket::send_close() {
 		memset(recvSegment,0,MAX_SEG_SIZE);
 	}
 	
+	this->set_timeout_length(this->cap_wait(0));
 	while(1) {
 		memset(recvSegment, 0, MAX_SEG_SIZE);
-		int received_bytes = recv(this->sock_fd, recvSegment, MAX_SEG_SIZE, 0);
+		int received_bytes = this->recv_segment(recvSegment);
 		if (received_bytes < 0 && errno != EAGAIN) {
-			perror("send_close recv error");
-			exit(EXIT_FAILURE);	
+			this->fail(errno);
+			return;
 		}
 		else if (received_bytes < 0) {
+			if (!this->peer_alive()) {
+				return;
+			}
+			this->set_timeout_length(this->cap_wait(0));
 			continue;  //timeout	
 		} 
 		
@@ -408,16 +1669,16 @@ void ReliableSocket::send_close() {
 	}
 	
 	hdr = (RDTHeader*)sendSegment;
-	hdr->type = RDT_ACK;
+	hdr->type = RDT_CLOSE_ACK;
 	
 	while(1){
-		if (send(this->sock_fd, sendSegment, sizeof(RDTHeader), 0) < 0) {
+		if (this->send_segment(sendSegment, sizeof(RDTHeader)) < 0) {
 			perror("send_close send error");		
 		}
 		
 		memset(recvSegment, 0, MAX_SEG_SIZE);
 		this->set_timeout_length(WAIT_TIME);
-		if (recv(this->sock_fd, recvSegment, MAX_SEG_SIZE, 0) > 0) {
+		if (this->recv_segment(recvSegment) > 0) {
 			hdr = (RDTHeader*)recvSegment;
 			if (hdr->type == RDT_CLOSE) {
 				continue;
@@ -430,8 +1691,8 @@ void ReliableSocket::send_close() {
 				//got the timeout so we can close	
 			}
 			else {
-				perror("send_close recv error");
-				exit(EXIT_FAILURE);	
+				this->fail(errno);
+				return;
 			}	
 		}	
 	}	
@@ -452,28 +1713,34 @@ void ReliableSocket::recv_close() {
 	while(1) {
 		//keep sending close until we get the final ack 
 		memset(recvSegment,0,MAX_SEG_SIZE);
-		this->send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader));
+		if (!this->send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader))) {
+			return; // timed out
+		}
 		hdr = (RDTHeader*)recvSegment;
-		if (hdr->type == RDT_ACK) {
+		if (hdr->type == RDT_CLOSE_ACK) {
 			break;	
 		}
 	}
 }
 
-void ReliableSocket::send_seg_reliable(char sendSegment[MAX_SEG_SIZE], char recvSegment[MAX_SEG_SIZE], int senderSize){
+bool ReliableSocket::send_seg_reliable(char sendSegment[MAX_SEG_SIZE], char recvSegment[MAX_SEG_SIZE], int senderSize){
 	int airTime; 
-	this->set_timeout_length(this->estimated_rtt + (4*this->dev_rtt));
+	this->set_timeout_length(this->cap_wait(this->estimated_rtt + (4*this->dev_rtt)));
 	bool lastTimeout = false; //bool did we timeout last time or not
 	uint32_t curTimeout; //stores previous timeout length
 
 	while(1){
-		airTime = current_msec(); //get current time 
-		if(send(this->sock_fd, sendSegment, senderSize, 0) < 0){ perror("reliable send failed");}
+		if(this->send_segment(sendSegment, senderSize) < 0){ perror("reliable send failed");}
+		airTime = current_msec(); //get current time, once pace() has let the segment go
 		//clear recv buffer to be ready to write new info in
 		memset(recvSegment,0,MAX_SEG_SIZE);
-		int numBytes = recv(this->sock_fd, recvSegment, MAX_SEG_SIZE,0);
+		int numBytes = this->recv_segment(recvSegment);
 		if(numBytes < 0){
 			if(errno == EAGAIN){
+				this->record_loss(1, 1);
+				if (!this->peer_alive() || this->give_up(true)) {
+					return false;
+				}
 				cerr << "TIMEOUT. DOUBLING THE LENGTH OF TIMEOUT\n";
 				if(lastTimeout){
 					curTimeout = 2*curTimeout; //double timeout length
@@ -481,40 +1748,41 @@ void ReliableSocket::send_seg_reliable(char sendSegment[MAX_SEG_SIZE], char recv
 				else{
 					curTimeout = (this->estimated_rtt + (4*this->dev_rtt))*2; //set timeout length
 				}
-				this->set_timeout_length(curTimeout);
+				this->set_timeout_length(this->cap_wait(curTimeout));
 				lastTimeout = true;
 				continue;
 			}
 			else{
-				perror("No ACK recv");
-				exit(EXIT_FAILURE);
+				this->fail(errno);
+				return false;
 			}
 
 		}
 		this->current_rtt = current_msec() - airTime; //the time it took to send
+		this->record_loss(1, 0);
 		break;
 	}
 	this->set_estimated_rtt();
-
+	return true;
 }
 
 void ReliableSocket::send_timeout(char sendSegment[MAX_SEG_SIZE]) {
 	char recvSegment[MAX_SEG_SIZE];
 
 	while(1) {
-		if (send(this->sock_fd, sendSegment, sizeof(RDTHeader), 0) < 0) {
+		if (this->send_segment(sendSegment, sizeof(RDTHeader)) < 0) {
 			perror("send_timeout send error");	
 		}
 
 		memset(recvSegment,0,MAX_SEG_SIZE);
 		set_timeout_length(this->estimated_rtt + (4* this->dev_rtt));
-		if (recv(this->sock_fd, recvSegment, MAX_SEG_SIZE, 0) < 0) {
+		if (this->recv_segment(recvSegment) < 0) {
 			if (errno == EAGAIN) {
 				break; // timeout
 			}
 			else {
-				perror("send_timeout recieve error");	
-				exit(EXIT_FAILURE);
+				this->fail(errno);
+				break;
 			}	
 		}
 		else {
@@ -522,3 +1790,595 @@ void ReliableSocket::send_timeout(char sendSegment[MAX_SEG_SIZE]) {
 		}	
 	}	
 }
+
+bool ReliableSocket::send_fec_group() {
+	int group_size = this->fec_pending.size();
+	if (group_size == 0) {
+		return true;
+	}
+	uint64_t base = this->sequence_number;
+
+	// Build every segment of the group up front: data segments 0 through
+	// group_size-1, then the parity segment at index group_size. Every
+	// segment carries the group's first byte as its sequence number, since
+	// the receiver only learns where each payload lands once it has them
+	// all. The parity payload is the XOR of all data payloads (zero padded
+	// to the longest), and the XOR of their lengths lets the receiver trim a
+	// rebuilt payload.
+	std::vector<char> segments((group_size + 1) * MAX_SEG_SIZE, 0);
+	int seg_lengths[MAX_FEC_GROUP + 1];
+	char *parity = &segments[group_size * MAX_SEG_SIZE];
+	int parity_len = 0;
+	int len_xor = 0;
+	int group_bytes = 0;
+
+	for (int i = 0; i < group_size; i++) {
+		std::vector<char> &payload = this->fec_pending[i];
+		RDTHeader *hdr = (RDTHeader*)&segments[i * MAX_SEG_SIZE];
+		hdr->sequence_number = htonl((uint32_t)base);
+		hdr->ack_number = htonl(fec_pack_info(group_size, i, 0));
+		hdr->type = RDT_DATA;
+		memcpy(hdr+1, payload.data(), payload.size());
+		seg_lengths[i] = sizeof(RDTHeader) + payload.size();
+
+		fec_xor_into(parity + sizeof(RDTHeader), payload.data(), payload.size());
+		if ((int)payload.size() > parity_len) {
+			parity_len = payload.size();
+		}
+		len_xor ^= payload.size();
+		group_bytes += payload.size();
+	}
+
+	RDTHeader *hdr = (RDTHeader*)parity;
+	hdr->sequence_number = htonl((uint32_t)base);
+	hdr->ack_number = htonl(fec_pack_info(group_size, group_size, len_xor));
+	hdr->type = RDT_PARITY;
+	seg_lengths[group_size] = sizeof(RDTHeader) + parity_len;
+
+	uint32_t full_mask = (1u << group_size) - 1;
+	uint32_t acked = 0;
+	uint32_t timeout = this->estimated_rtt + (4*this->dev_rtt);
+	bool resend = true;
+	bool retransmitted = false;
+	int parity_time = 0;
+	int deadline = 0;
+	int round_sent = 0;
+	uint32_t round_start_acked = 0;
+
+	// Each round sends the segments in order[], at most FEC_WINDOW of them
+	// ahead of the last one the receiver has acknowledged, so a group never
+	// arrives as a burst that overflows a short queue. Every segment gets a
+	// GROUP_ACK, which clocks out the next. Segments before one that was
+	// acknowledged are presumed lost and no longer hold up the window.
+	int order[MAX_FEC_GROUP + 1];
+	int round_len = 0;
+	int next = 0;
+	int last_seen = -1;
+	bool parity_sent = false;
+
+	while (acked != full_mask) {
+		if (this->give_up(resend && retransmitted)) {
+			this->fec_pending.clear();
+			return false;
+		}
+		if (resend) {
+			// (Re)send whatever the receiver is missing, always followed by
+			// the parity segment so one more loss can still be repaired.
+			round_len = 0;
+			for (int i = 0; i <= group_size; i++) {
+				if (i == group_size || !(acked & (1u << i))) {
+					order[round_len++] = i;
+				}
+			}
+			round_sent = 0;
+			round_start_acked = acked;
+			next = 0;
+			last_seen = -1;
+			parity_sent = false;
+			resend = false;
+		}
+		while (next < round_len && next - (last_seen + 1) < FEC_WINDOW) {
+			int i = order[next++];
+			if (i < group_size && (acked & (1u << i))) {
+				continue; // acknowledged since the round started
+			}
+			if (i == group_size && acked == full_mask) {
+				break;
+			}
+			round_sent++;
+			if (this->send_segment(&segments[i * MAX_SEG_SIZE], seg_lengths[i]) < 0) {
+				perror("fec group send failed");
+			}
+			if (i == group_size) {
+				parity_sent = true;
+				parity_time = current_msec();
+			}
+			deadline = current_msec() + timeout;
+		}
+
+		int remaining = deadline - current_msec();
+		if (remaining <= 0) {
+			cerr << "TIMEOUT. DOUBLING THE LENGTH OF TIMEOUT\n";
+			// Count everything not newly acknowledged this round (and the
+			// parity, whose ACK never came) as lost.
+			int newly_acked = __builtin_popcount(acked & ~round_start_acked);
+			this->record_loss(round_sent, round_sent - newly_acked);
+			timeout *= 2;
+			resend = true;
+			retransmitted = true;
+			continue;
+		}
+		this->set_timeout_length(this->cap_wait(remaining));
+
+		char recvSegment[MAX_SEG_SIZE];
+		memset(recvSegment,0,MAX_SEG_SIZE);
+		if (this->recv_segment(recvSegment) < 0) {
+			if (errno == EAGAIN) {
+				if (!this->peer_alive()) {
+					this->fec_pending.clear();
+					return false;
+				}
+				continue; // deadline check above handles the timeout
+			}
+			this->fail(errno);
+			this->fec_pending.clear();
+			return false;
+		}
+
+		hdr = (RDTHeader*)recvSegment;
+		if (hdr->type != RDT_GROUP_ACK || ntohl(hdr->sequence_number) != (uint32_t)base) {
+			this->answer_stray(recvSegment);
+			continue; // stale or unrelated segment
+		}
+		uint32_t mask = ntohl(hdr->ack_number);
+		acked |= mask & full_mask;
+		bool parity_seen = (mask & FEC_PARITY_SEEN) != 0;
+		for (int k = last_seen + 1; k < next; k++) {
+			if (order[k] == group_size ? parity_seen : (acked & (1u << order[k])) != 0) {
+				last_seen = k;
+			}
+		}
+
+		if (!retransmitted && (parity_seen || acked == full_mask)) {
+			// The first round is over, either because the receiver saw our
+			// parity or because every data segment arrived. Its count tells
+			// us exactly how many of our segments got through.
+			int considered = (parity_sent && !parity_seen) ? round_sent - 1 : round_sent;
+			int received = (mask & FEC_RECV_COUNT_MASK) >> FEC_RECV_COUNT_SHIFT;
+			this->record_loss(considered, considered - std::min(received, considered));
+			if (parity_seen) {
+				this->current_rtt = current_msec() - parity_time;
+				this->set_estimated_rtt();
+			}
+		}
+		if (parity_seen && acked != full_mask) {
+			// The receiver has seen this round's parity, so anything it
+			// still lacks was lost beyond repair: resend it right away
+			// instead of waiting out the timeout.
+			resend = true;
+			retransmitted = true;
+		}
+	}
+
+	this->sequence_number += group_bytes;
+	this->fec_pending.clear();
+	return true;
+}
+
+bool ReliableSocket::give_up(bool retransmit) {
+	if (this->send_has_deadline && current_msec() - this->send_deadline >= 0) {
+		return true;
+	}
+	if (retransmit && this->send_retransmits_left >= 0) {
+		if (this->send_retransmits_left == 0) {
+			return true;
+		}
+		this->send_retransmits_left--;
+	}
+	return false;
+}
+
+uint32_t ReliableSocket::cap_wait(uint32_t timeout) {
+	int now = current_msec();
+	int limit = -1;
+	auto cap = [&limit](int remaining) {
+		if (limit < 0 || remaining < limit) {
+			limit = std::max(remaining, 1);
+		}
+	};
+	if (this->send_has_deadline) {
+		cap(this->send_deadline - now);
+	}
+	if (this->idle_timeout > 0) {
+		cap(this->last_heard + this->idle_timeout - now);
+	}
+	if (this->state == ESTABLISHED || this->state == FIN) {
+		// Waits for an answer resend anyway, so only waits with no limit
+		// need to stop for probes
+		if (this->keepalive_interval > 0 && timeout == 0) {
+			cap(this->last_sent + this->keepalive_interval - now);
+		}
+	}
+	if (limit > 0 && (timeout == 0 || limit < (int)timeout)) {
+		return limit;
+	}
+	return timeout;
+}
+
+void ReliableSocket::set_rate_limit(uint64_t bytes_per_sec, int burst_bytes) {
+	if (this->rate_limit == NULL) {
+		if (bytes_per_sec == 0) {
+			return; // no limit, and none to lift
+		}
+		this->rate_limit = rate_new();
+	}
+	rate_set(this->rate_limit, bytes_per_sec, rate_burst(bytes_per_sec, burst_bytes));
+}
+
+void ReliableSocket::set_global_rate_limit(uint64_t bytes_per_sec, int burst_bytes) {
+	rate_set(global_rate_limit, bytes_per_sec, rate_burst(bytes_per_sec, burst_bytes));
+}
+
+uint64_t ReliableSocket::rate_burst(uint64_t bytes_per_sec, int burst_bytes) {
+	if (burst_bytes > 0) {
+		return burst_bytes;
+	}
+	return std::max(bytes_per_sec * RATE_BURST_MS / 1000, (uint64_t)MAX_SEG_SIZE);
+}
+
+void ReliableSocket::set_idle_timeout(int timeout_ms, int keepalive_ms) {
+	this->idle_timeout = std::max(timeout_ms, 0);
+	this->keepalive_interval = std::max(keepalive_ms, 0);
+}
+
+void ReliableSocket::keepalive() {
+	if ((this->state == ESTABLISHED || this->state == FIN)
+			&& this->keepalive_interval > 0
+			&& current_msec() - this->last_sent >= this->keepalive_interval) {
+		this->send_keepalive(false);
+	}
+}
+
+bool ReliableSocket::timed_out() {
+	return this->error == std::errc::timed_out;
+}
+
+std::error_code ReliableSocket::get_error() {
+	return this->error;
+}
+
+void ReliableSocket::fail(int error_number) {
+	this->error = std::error_code(error_number, std::generic_category());
+	cerr << "ERROR: Connection failed: " << this->error.message() << "\n";
+	this->state = FAILED;
+	this->cork_buffer.clear();
+	this->fec_pending.clear();
+}
+
+bool ReliableSocket::peer_alive() {
+	if (this->state == FAILED) {
+		return false;
+	}
+	// While connecting, last_heard is when connect_to_remote started if
+	// nothing has been heard yet
+	if (this->idle_timeout > 0 && current_msec() - this->last_heard >= this->idle_timeout) {
+		cerr << "INFO: Nothing heard from the remote host for "
+			<< this->idle_timeout << " ms\n";
+		this->fail(ETIMEDOUT);
+		return false;
+	}
+	if (this->state == ESTABLISHED || this->state == FIN) {
+		this->keepalive(); // no one to probe before the connection is set up
+	}
+	return true;
+}
+
+void ReliableSocket::send_keepalive(bool reply) {
+	char segment[sizeof(RDTHeader)] = {0};
+	RDTHeader *hdr = (RDTHeader*)segment;
+	hdr->sequence_number = htonl((uint32_t)this->sequence_number);
+	hdr->ack_number = htonl(reply ? 1 : 0);
+	hdr->type = RDT_KEEPALIVE;
+	if (this->send_segment(segment, sizeof(RDTHeader)) < 0) {
+		perror("keepalive send error");
+	}
+}
+
+void ReliableSocket::send_skip(uint64_t target, int stream) {
+	char sendSegment[MAX_SEG_SIZE]={0};
+	char recvSegment[MAX_SEG_SIZE];
+	RDTHeader *hdr = (RDTHeader*)sendSegment;
+	hdr->sequence_number = htonl((uint32_t)target);
+	hdr->ack_number = htonl(stream); // so only that stream's message is dropped
+	hdr->type = RDT_SKIP;
+
+	// The skip itself has to get through, or the receiver would wait for
+	// the abandoned data forever
+	while (1) {
+		if (!this->send_seg_reliable(sendSegment, recvSegment, sizeof(RDTHeader))) {
+			return; // timed out
+		}
+		hdr = (RDTHeader*)recvSegment;
+		if (hdr->type == RDT_ACK && seq_compare(seq_unwrap(ntohl(hdr->ack_number),
+						target), target) >= 0) {
+			break;
+		}
+		this->answer_stray(recvSegment);
+	}
+	this->sequence_number = target;
+}
+
+void ReliableSocket::recv_fec_segment(char segment[MAX_SEG_SIZE], int length) {
+	RDTHeader *hdr = (RDTHeader*)segment;
+	uint32_t info = ntohl(hdr->ack_number);
+	int group_size = fec_info_group_size(info);
+	int index = fec_info_index(info);
+	int payload_len = length - sizeof(RDTHeader);
+	bool is_parity = (hdr->type == RDT_PARITY);
+
+	if (group_size < 1 || group_size > MAX_FEC_GROUP || index > group_size
+			|| is_parity != (index == group_size) || payload_len < 0) {
+		cerr << "INFO: Dropping malformed FEC segment\n";
+		return;
+	}
+
+	uint64_t base = seq_unwrap(ntohl(hdr->sequence_number),
+			this->expected_sequence_number);
+	uint32_t full_mask = (1u << group_size) - 1;
+
+	if (base != this->expected_sequence_number) {
+		// A retransmission from the group we already delivered means our
+		// final group ACK was lost, so repeat it.
+		if (base == this->fec_done_base && group_size == this->fec_done_size) {
+			this->send_group_ack(base, full_mask);
+		}
+		return;
+	}
+
+	if (this->fec_recv_size != group_size) {
+		// First segment of a new group
+		this->fec_recv_size = group_size;
+		this->fec_recv_mask = 0;
+		this->fec_recv_count = 0;
+		this->fec_have_parity = false;
+	}
+	if (this->fec_recv_count < 0xFF) {
+		this->fec_recv_count++;
+	}
+
+	const char *payload = segment + sizeof(RDTHeader);
+	if (is_parity) {
+		this->fec_recv_parity.assign(payload, payload + payload_len);
+		this->fec_parity_len_xor = fec_info_extra(info);
+		this->fec_have_parity = true;
+	}
+	else if (!(this->fec_recv_mask & (1u << index))) {
+		this->fec_recv_payloads[index].assign(payload, payload + payload_len);
+		this->fec_recv_mask |= 1u << index;
+	}
+
+	uint32_t missing = full_mask & ~this->fec_recv_mask;
+	if (missing != 0 && this->fec_have_parity && (missing & (missing - 1)) == 0) {
+		// Exactly one data segment is missing: XOR the parity with every
+		// segment we have to get it back.
+		int lost = __builtin_ctz(missing);
+		std::vector<char> &rebuilt = this->fec_recv_payloads[lost];
+		rebuilt = this->fec_recv_parity;
+		int rebuilt_len = this->fec_parity_len_xor;
+		for (int i = 0; i < group_size; i++) {
+			if (i != lost) {
+				std::vector<char> &other = this->fec_recv_payloads[i];
+				fec_xor_into(rebuilt.data(), other.data(), other.size());
+				rebuilt_len ^= other.size();
+			}
+		}
+		if (rebuilt_len <= (int)rebuilt.size()) {
+			rebuilt.resize(rebuilt_len);
+			this->fec_recv_mask = full_mask;
+			cerr << "INFO: Rebuilt segment " << lost << " of group " << base
+				<< " from parity\n";
+		}
+	}
+
+	uint32_t ack_mask = this->fec_recv_mask | (is_parity ? FEC_PARITY_SEEN : 0)
+		| ((uint32_t)this->fec_recv_count << FEC_RECV_COUNT_SHIFT);
+	if (this->fec_recv_mask == full_mask) {
+		for (int i = 0; i < group_size; i++) {
+			this->expected_sequence_number += this->fec_recv_payloads[i].size();
+			this->ready_segments.push_back(std::vector<char>());
+			this->ready_segments.back().swap(this->fec_recv_payloads[i]);
+		}
+		this->fec_done_base = base;
+		this->fec_done_size = group_size;
+		this->fec_recv_size = 0;
+	}
+	this->send_group_ack(base, ack_mask);
+}
+
+void ReliableSocket::send_group_ack(uint64_t base, uint32_t mask) {
+	char sendSegment[sizeof(RDTHeader)]={0};
+	RDTHeader *hdr = (RDTHeader*)sendSegment;
+	hdr->sequence_number = htonl((uint32_t)base);
+	hdr->ack_number = htonl(mask);
+	hdr->type = RDT_GROUP_ACK;
+	if (this->send_segment(sendSegment, sizeof(RDTHeader)) < 0) {
+		perror("send_group_ack send error");
+	}
+}
+
+void ReliableSocket::deflate_and_send(const void *data, int length, int flush) {
+	if (this->deflater == NULL) {
+		this->deflater = new z_stream();
+		if (deflateInit(this->deflater, this->compress_level) != Z_OK) {
+			cerr << "ERROR: deflateInit failed\n";
+			delete this->deflater;
+			this->deflater = NULL;
+			this->fail(ENOMEM);
+			return;
+		}
+		this->deflate_out.resize(MAX_DATA_SIZE);
+		this->deflate_out_len = 0;
+	}
+
+	// Feed the input one block at a time so the level can be re-tuned at
+	// each block boundary.
+	const char *input = (const char*)data;
+	do {
+		int chunk = std::min(length, COMPRESS_BLOCK_SIZE - this->compress_block_in);
+		bool last = (chunk == length);
+		bool block_end = (this->compress_block_in + chunk >= COMPRESS_BLOCK_SIZE);
+
+		// Ending the deflate block at a block boundary makes zlib emit what
+		// it has buffered, so the measured ratio is for this block alone.
+		int chunk_flush = last ? flush : Z_NO_FLUSH;
+		if (block_end && chunk_flush == Z_NO_FLUSH) {
+			chunk_flush = Z_BLOCK;
+		}
+		this->deflate_chunk(input, chunk, chunk_flush);
+		input += chunk;
+		length -= chunk;
+		if (this->compress_block_in >= COMPRESS_BLOCK_SIZE) {
+			this->tune_compression();
+		}
+	} while (length > 0);
+}
+
+void ReliableSocket::deflate_chunk(const char *data, int length, int flush) {
+	z_stream *strm = this->deflater;
+	strm->next_in = (Bytef*)data;
+	strm->avail_in = length;
+	uLong start_out = strm->total_out;
+	int capacity = this->max_payload();
+	while (1) {
+		strm->next_out = (Bytef*)&this->deflate_out[this->deflate_out_len];
+		strm->avail_out = capacity - this->deflate_out_len;
+
+		// Time only the compressor itself (on this thread's CPU clock), not
+		// the sends, so we know what compression really costs.
+		struct timespec before, after;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &before);
+		int ret = deflate(strm, flush);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &after);
+		this->compress_block_nsec += (after.tv_sec - before.tv_sec) * 1000000000LL
+			+ (after.tv_nsec - before.tv_nsec);
+
+		this->deflate_out_len = capacity - strm->avail_out;
+
+		// Only full segments go out until we're asked to flush, so small
+		// writes share segments instead of each costing a round trip.
+		bool done = (flush == Z_NO_FLUSH) ? (strm->avail_in == 0 && strm->avail_out > 0)
+			: (strm->avail_out > 0 && (flush != Z_FINISH || ret == Z_STREAM_END));
+		bool send_partial = (flush != Z_NO_FLUSH && flush != Z_BLOCK);
+		if (this->deflate_out_len == capacity
+				|| (done && send_partial && this->deflate_out_len > 0)) {
+			this->send_payload(this->deflate_out.data(), this->deflate_out_len);
+			this->deflate_out_len = 0;
+		}
+		if (done) {
+			break;
+		}
+	}
+
+	int produced = strm->total_out - start_out;
+	this->compress_block_in += length;
+	this->compress_block_out += produced;
+	this->compress_total_in += length;
+	this->compress_total_out += produced;
+}
+
+void ReliableSocket::tune_compression() {
+	double ratio = (double)this->compress_block_out / this->compress_block_in;
+	double cpu_sec = std::max(this->compress_block_nsec / 1e9, 1e-6);
+	double compress_rate = this->compress_block_in / cpu_sec;
+
+	// Stop-and-wait moves at most one segment per RTT, so that is the rate
+	// the link can take (in bytes per second).
+	double link_rate = this->max_payload() * 1000.0 / std::max(this->estimated_rtt, 1);
+
+	// Levels we step through: 0 stores blocks uncompressed (practically a
+	// memcpy), 1 is zlib's fastest and Z_DEFAULT_COMPRESSION is 6.
+	static const int levels[] = {0, 1, 3, 6};
+	int step = 0;
+	while (step < 3 && levels[step] < this->compress_level) {
+		step++;
+	}
+
+	int new_step = step;
+	if (step == 0) {
+		// Bypassed: every so often try compressing again, in case the data
+		// or the link changed.
+		if (--this->compress_probe_countdown <= 0) {
+			new_step = 1;
+		}
+	}
+	else if (ratio > COMPRESS_BYPASS_RATIO || compress_rate < link_rate) {
+		// Already compressed data, or compressing is slower than just
+		// sending: stop compressing for a while.
+		new_step = 0;
+		this->compress_probe_countdown = COMPRESS_PROBE_BLOCKS;
+	}
+	else if (compress_rate < link_rate / ratio && step > 1) {
+		new_step = step - 1; // compressor limits throughput: go faster
+	}
+	else if (compress_rate > 4 * link_rate / ratio && step < 3) {
+		new_step = step + 1; // plenty of CPU headroom: compress harder
+	}
+
+	if (levels[new_step] != this->compress_level) {
+		cerr << "INFO: Compression ratio " << ratio << " at "
+			<< compress_rate / 1e6 << " MB/s (link " << link_rate / 1e6
+			<< " MB/s), level " << this->compress_level << " -> "
+			<< levels[new_step] << "\n";
+		this->set_compression_level(levels[new_step]);
+	}
+
+	this->compress_block_in = 0;
+	this->compress_block_out = 0;
+	this->compress_block_nsec = 0;
+}
+
+void ReliableSocket::set_compression_level(int level) {
+	// Changing the level makes zlib compress what it has buffered using the
+	// old level first, which may need more output space than we have left.
+	z_stream *strm = this->deflater;
+	strm->next_in = NULL;
+	strm->avail_in = 0;
+	int capacity = this->max_payload();
+	while (1) {
+		strm->next_out = (Bytef*)&this->deflate_out[this->deflate_out_len];
+		strm->avail_out = capacity - this->deflate_out_len;
+		int ret = deflateParams(strm, level, Z_DEFAULT_STRATEGY);
+		this->deflate_out_len = capacity - strm->avail_out;
+		if (this->deflate_out_len == capacity) {
+			this->send_payload(this->deflate_out.data(), this->deflate_out_len);
+			this->deflate_out_len = 0;
+		}
+		if (ret == Z_OK) {
+			this->compress_level = level;
+			return;
+		}
+		if (ret != Z_BUF_ERROR || strm->avail_out > 0) {
+			return; // keep the old level and try again next block
+		}
+	}
+}
+
+double ReliableSocket::get_compression_ratio() {
+	if (this->compress_total_in == 0) {
+		return 1;
+	}
+	return (double)this->compress_total_out / this->compress_total_in;
+}
+
+void ReliableSocket::end_compression() {
+	if (this->deflater != NULL) {
+		deflateEnd(this->deflater);
+		delete this->deflater;
+		this->deflater = NULL;
+	}
+	if (this->inflater != NULL) {
+		inflateEnd(this->inflater);
+		delete this->inflater;
+		this->inflater = NULL;
+	}
+}
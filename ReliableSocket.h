@@ -5,23 +5,102 @@
  * unreliable link.
  *
  */
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <mutex>
+#include <system_error>
 
 // TODO: You'll likely need to add some new types, as you start doing things
 // like updating accept_connection and close_connection.
-enum RDTMessageType : uint8_t {RDT_SYN, RDT_SYNACK,  RDT_ACK, RDT_DATA, RDT_CLOSE};
+enum RDTMessageType : uint8_t {RDT_SYN, RDT_SYNACK,  RDT_ACK, RDT_DATA, RDT_CLOSE,
+	RDT_PARITY, RDT_GROUP_ACK, RDT_SKIP, RDT_KEEPALIVE, RDT_PATH_CHALLENGE,
+	RDT_PATH_RESPONSE, RDT_COOKIE_ECHO, RDT_CLOSE_ACK};
 
 /**
  * Format for the header of a segment send by our reliable socket.
+ *
+ * The connection ID is picked by the initiator and carried by every
+ * segment of the connection. It, not the addresses the segments come
+ * from, tells which connection a segment belongs to, so a connection
+ * survives either end's address changing (e.g. a NAT rebinding its port).
  */
 struct RDTHeader {
 	uint32_t sequence_number;
 	uint32_t ack_number;
+	uint32_t connection_id;
 	RDTMessageType type;
 };
 
+// Options negotiated during the handshake. The RDT_SYN lists the options the
+// initiator would like to use and the RDT_SYNACK lists the ones the listener
+// agreed to; only those are used on the connection.
+enum RDTOption : uint32_t { RDT_OPT_COMPRESS = 1 << 0, RDT_OPT_ENCRYPT = 1 << 1,
+	RDT_OPT_RESUME = 1 << 2 };
+
+// Flags for ReliableSocket::receive and receivev
+enum RDTReceiveFlag { RDT_WAITALL = 1 << 0 };
+
+/**
+ * Format of the payload of RDT_SYN and RDT_SYNACK segments.
+ *
+ * When the ends share a key, the payload is followed by a tag computed with
+ * that key, and the two nonces seed the connection's encryption keys. A
+ * SYNACK agreeing to RDT_OPT_RESUME also offers to resume a transfer after
+ * its first resume_offset bytes, whose hash is resume_hash (both in network
+ * byte order).
+ */
+struct RDTHandshake {
+	uint32_t options;
+	uint8_t nonce[16];
+	uint64_t resume_offset;
+	uint64_t resume_hash;
+};
+
+/**
+ * Format of the payload of RDT_COOKIE_ECHO segments, which the initiator
+ * sends in answer to the RDT_SYNACK: its SYN's payload again, and the
+ * SYNACK's nonce, which is the listener's SYN cookie.
+ *
+ * The listener keeps nothing for a SYN. The cookie is a MAC, under a secret
+ * only the listener knows, of the SYN, the address it came from, the
+ * listener's (random) ISN and the COOKIE_LIFETIME second time slot it was
+ * made in, so the echo lets it rebuild the connection and check that the
+ * initiator really is at that address. The echo is signed like the SYN if the ends
+ * share a key.
+ */
+struct RDTCookieEcho {
+	RDTHandshake syn;
+	uint8_t cookie[16];
+};
+
+/**
+ * A read-only view of received data, lent to the application by
+ * ReliableSocket::receive_loan or receive_message. The data stays valid
+ * until the loan is passed to release_loan.
+ */
+struct RDTLoan {
+	const char *data;
+	int length;
+	int id;
+};
+
+// zlib stream state, kept opaque so applications don't need zlib.h
+struct z_stream_s;
+
+// Encryption state (see rdt_crypto.h)
+struct CryptoSession;
+
+// Rate limiting state (see rdt_rate.h)
+struct RateBucket;
+
 // TODO: Again, you'll likely need to add new statuses (is that a word?) as
 // you start implementing the reliable protocol.
-enum connection_status { INIT, ESTABLISHED, FIN, CLOSED };
+enum connection_status { INIT, ESTABLISHED, FIN, CLOSED, FAILED };
 
 /**
  * Class that represents a socket using a reliable data transport protocol.
@@ -39,6 +118,14 @@ public:
 	static const int MAX_SEG_SIZE  = 1400;
 	static const int WAIT_TIME = 4000;
 	static const int MAX_DATA_SIZE = MAX_SEG_SIZE - sizeof(RDTHeader);
+	static const int MAX_FEC_GROUP = 16;
+	static const int FEC_AUTO = -1;
+	static const int FEC_WINDOW = 2;
+	static const int CORK_DELAY = 200;
+	static const int CONNECT_ATTEMPT_DELAY = 250;
+	static const int COOKIE_LIFETIME = 64;
+	static const int RATE_BURST_MS = 10;
+	static const int MAX_STREAM = 65535;
 
 	/**
 	 * Basic Constructor, setting estimated RTT to 100 and deviation RTT to 10.
@@ -48,25 +135,41 @@ public:
 	/**
 	 * Connects to the specified remote hostname on the given port.
 	 *
-	 * @param hostname Name of the remote host to connect to.
+	 * When the name has several addresses (e.g. IPv6 and IPv4 ones), they
+	 * are raced, happy eyeballs style (RFC 8305): a SYN goes to one address
+	 * after another, CONNECT_ATTEMPT_DELAY ms apart, alternating between
+	 * IPv6 and IPv4 in the order the resolver prefers, and the first to
+	 * answer is used.
+	 *
+	 * @param hostname Name or address (IPv4 or IPv6) of the remote host to
+	 * 		connect to.
 	 * @param port_num Port number of remote host.
+	 * @return false if the connection couldn't be made (see get_error).
 	 */
-	void connect_to_remote(char *hostname, int port_num);
+	bool connect_to_remote(const char *hostname, int port_num);
 
 	/**
-	 * Waits for a connection attempt from a remote host.
+	 * Waits for a connection attempt from a remote host, over IPv6 or IPv4
+	 * (where the host has IPv6, the socket is dual-stack).
+	 *
+	 * SYNs are answered with a SYN cookie (see RDTCookieEcho) and nothing is
+	 * kept for them, so a flood of SYNs from forged addresses costs a MAC
+	 * each and can't crowd out a real connection attempt. The connection is
+	 * set up from the first valid cookie echo.
 	 *
 	 * @param port_num The port number to listen on.
+	 * @return false if no connection could be made (see get_error).
 	 */
-	void accept_connection(int port_num);
+	bool accept_connection(int port_num);
 
 	/**
 	 * Send data to connected remote host.
 	 *
 	 * @param buffer The buffer with data to be sent.
 	 * @param length The amount of data in the buffer to send.
+	 * @return false if the connection isn't established or has failed.
 	 */
-	void send_data(const void *buffer, int length);
+	bool send_data(const void *buffer, int length);
 
 	/**
 	 * Receives data from remote host using a reliable connection.
@@ -76,10 +179,186 @@ public:
 	 */
 	int receive_data(char buffer[MAX_DATA_SIZE]);
 
+	/**
+	 * Receives data from remote host into a buffer of any size. Waits for
+	 * at least one byte, then copies in as many in-order bytes as the socket
+	 * already holds (e.g. the rest of an FEC group or of a decompressed
+	 * segment), up to capacity.
+	 *
+	 * @param buffer The buffer where received data will be stored.
+	 * @param capacity The size of buffer.
+	 * @param flags RDT_WAITALL to keep receiving until buffer is full or
+	 * 		the connection is closed.
+	 * @return The amount of data actually received (0 once the connection
+	 * is closed, -1 if it failed; see get_error).
+	 */
+	int receive(void *buffer, int capacity, int flags = 0);
+
+	/**
+	 * Like receive, but scatters the data over several buffers, filling each
+	 * in turn (like readv).
+	 *
+	 * @param iov The buffers where received data will be stored.
+	 * @param iovcnt The number of buffers.
+	 * @param flags See receive.
+	 * @return The total amount of data received (or -1, as for receive).
+	 */
+	int receivev(const struct iovec *iov, int iovcnt, int flags = 0);
+
+	/**
+	 * Receives the next in-order data without copying it to the caller:
+	 * the loan points into the socket's own buffer, where the payload was
+	 * received (or, on compressed connections, decompressed). Each call
+	 * returns one segment's worth of data.
+	 *
+	 * Every loan must be handed back with release_loan, after which its
+	 * buffer is reused. Any number of loans may be held at once.
+	 *
+	 * @param loan Filled in with the data and its length.
+	 * @return The amount of data lent (0 once the connection is closed, -1
+	 * if it failed).
+	 */
+	int receive_loan(RDTLoan *loan);
+
+	/**
+	 * Returns a loan's buffer to the socket. This may be called from any
+	 * thread.
+	 *
+	 * @param loan A loan from receive_loan or receive_message.
+	 */
+	void release_loan(const RDTLoan &loan);
+
+	/**
+	 * Sends data as one message (record) of any size, which the remote host
+	 * gets back whole, and on its own, from receive_message. Messages are
+	 * split across as many segments as they need.
+	 *
+	 * Both ends must stick to messages: the stream calls (send_data,
+	 * receive...) don't know about message boundaries. Messages can't be
+	 * sent on compressed connections, where segment boundaries are lost.
+	 *
+	 * Messages can be sent partially reliably, for data that goes stale
+	 * (such as telemetry): given a lifetime or a retransmission limit, the
+	 * sender gives up on the message once either runs out and tells the
+	 * receiver to skip it, so it never holds up the messages after it.
+	 * receive_message then simply never returns it.
+	 *
+	 * @param data The message.
+	 * @param length The length of the message (may be 0).
+	 * @param lifetime_ms How long (in milliseconds) the message is worth
+	 * 		delivering, or 0 for as long as it takes.
+	 * @param max_retransmits How many times the message's segments may be
+	 * 		resent in all, or -1 for no limit.
+	 * @return true if the message was delivered, false if it was given up
+	 * on (in which case the receiver may or may not have it) or couldn't be
+	 * sent.
+	 */
+	bool send_message(const void *data, int length, int lifetime_ms = 0,
+			int max_retransmits = -1);
+
+	/**
+	 * Receives the next message sent with send_message, lent to the caller
+	 * as in receive_loan. A message that fit in one segment is lent straight
+	 * from the buffer it was received into; longer ones are reassembled.
+	 *
+	 * @param loan Filled in with the message and its length; hand it back
+	 * 		with release_loan.
+	 * @param stream If not NULL, set to the stream the message was queued
+	 * 		on (see queue_message), or 0 if it was sent with send_message.
+	 * @return The length of the message (which may be 0), or -1 once the
+	 * connection is closed or has failed.
+	 */
+	int receive_message(RDTLoan *loan, int *stream = NULL);
+
+	/**
+	 * Sets how messages queued on a stream (see queue_message) share the
+	 * connection with other streams. Priority is strict: while a stream has
+	 * messages queued, streams with a lower priority send nothing. Streams
+	 * of the same priority take turns, each sending in proportion to its
+	 * weight. Streams start out with priority 0 and weight 1.
+	 *
+	 * @param stream The stream (0 to MAX_STREAM).
+	 * @param priority The stream's priority (higher goes first).
+	 * @param weight The stream's share relative to streams of the same
+	 * 		priority (at least 1).
+	 */
+	void set_stream_priority(int stream, int priority, int weight);
+
+	/**
+	 * Queues a message on a stream, to be sent by send_queued. The remote
+	 * host receives it as if sent by send_message.
+	 *
+	 * Unlike the rest of this class, this may be called from any thread,
+	 * including while another thread is in send_queued. Streams are
+	 * interleaved a segment at a time, so a message queued on a more urgent
+	 * stream goes out after at most one more segment of a long message
+	 * from a less urgent one.
+	 *
+	 * @param stream The stream (0 to MAX_STREAM).
+	 * @param data The message, which is copied.
+	 * @param length The length of the message (may be 0).
+	 */
+	void queue_message(int stream, const void *data, int length);
+
+	/**
+	 * Sends queued messages, in the order set by their streams' priorities
+	 * and weights, until there are none left (including any queued in the
+	 * meantime), then flushes.
+	 *
+	 * @return The number of messages sent.
+	 */
+	int send_queued();
+
+	/**
+	 * Gives up on the connection when the remote host goes quiet, instead
+	 * of waiting on it forever. Whenever a call is waiting on the remote
+	 * host and nothing at all has been heard from it for timeout_ms, the
+	 * connection fails with std::errc::timed_out (see get_error). That
+	 * includes connect_to_remote, which gives up if the remote host hasn't
+	 * answered within timeout_ms.
+	 *
+	 * A host that is waiting (or calls keepalive) sends a keepalive probe
+	 * whenever it has sent nothing for keepalive_ms. The remote host
+	 * answers probes while it is in a call on the connection, so one in a
+	 * call never looks dead; an application that can go longer than the
+	 * remote host's timeout between calls should call keepalive meanwhile.
+	 *
+	 * @param timeout_ms How long to wait on a silent remote host, or 0 to
+	 * 		wait forever (the default).
+	 * @param keepalive_ms How long to stay silent before probing, or 0 to
+	 * 		never probe (the default).
+	 */
+	void set_idle_timeout(int timeout_ms, int keepalive_ms = 0);
+
+	/**
+	 * Sends a keepalive probe if nothing has been sent for the keepalive
+	 * interval (see set_idle_timeout). Doesn't wait for an answer.
+	 */
+	void keepalive();
+
+	/**
+	 * Returns whether the connection was dropped because the remote host
+	 * went quiet (see set_idle_timeout).
+	 */
+	bool timed_out();
+
+	/**
+	 * Returns why the connection failed, if it has. A failure (a socket
+	 * error, a timeout, a corrupt stream...) only affects this connection:
+	 * from then on receives return -1, sends return false or do nothing,
+	 * and close_connection just releases the socket.
+	 *
+	 * @return The error (errno values, in std::generic_category), or an
+	 * empty error_code if the connection hasn't failed.
+	 */
+	std::error_code get_error();
+
 	/**
 	 * Closes an connection.
+	 *
+	 * @return false if the connection had failed or failed while closing.
 	 */
-	void close_connection();
+	bool close_connection();
 
 	/**
 	 * Returns the estimated RTT.
@@ -88,18 +367,332 @@ public:
 	 */
 	uint32_t get_estimated_rtt();
 
+	/**
+	 * Enables compression of the data stream. This must be called before
+	 * connect_to_remote or accept_connection, and the connection is only
+	 * compressed if both ends enabled it.
+	 *
+	 * When compression is in use, data passed to send_data is compressed as
+	 * one continuous deflate stream and packed into full segments (anything
+	 * left over is sent by close_connection), and receive_data returns the
+	 * decompressed bytes.
+	 *
+	 * The sender tunes the compression level as it goes: data that doesn't
+	 * compress, or a link fast enough that the compressor would hold it
+	 * back, switches compression off (it is retried every so often), and
+	 * spare CPU on a slow link raises the level.
+	 *
+	 * @param enable Whether to offer/accept compression.
+	 */
+	void set_compression(bool enable);
+
+	/**
+	 * Sets the pre-shared key used to encrypt and authenticate the
+	 * connection. This must be called before connect_to_remote or
+	 * accept_connection, and both ends must use the same key.
+	 *
+	 * Once a key is set, plaintext connections are refused. Every segment
+	 * after the handshake is encrypted with AES-256-GCM under keys derived
+	 * from this key and fresh random nonces, and forged, tampered with or
+	 * replayed segments are dropped.
+	 *
+	 * @param key The 32 byte key.
+	 */
+	void set_psk(const uint8_t key[32]);
+
+	/**
+	 * Returns how well the data sent so far compressed.
+	 *
+	 * @return Compressed size divided by original size (1 if nothing was
+	 * compressed).
+	 */
+	double get_compression_ratio();
+
+	/**
+	 * Enables forward error correction (FEC) for data sent on this socket.
+	 * Data segments are sent in groups of group_size followed by one XOR
+	 * parity segment, so the receiver can rebuild a single lost segment per
+	 * group without waiting for a retransmission.
+	 *
+	 * @note Data passed to send_data is buffered until a group is full; any
+	 * partial group is sent by close_connection.
+	 *
+	 * With FEC_AUTO the group size is picked at the start of every group from
+	 * the measured loss rate (see get_loss_rate): FEC stays off on a clean
+	 * link and groups shrink (i.e. redundancy rises) as loss increases.
+	 *
+	 * @param group_size Data segments per group (2 to MAX_FEC_GROUP), 0 to
+	 * 		disable FEC, or FEC_AUTO.
+	 */
+	void set_fec_group_size(int group_size);
+
+	/**
+	 * Returns the estimated segment loss rate, measured from retransmissions
+	 * and group ACKs.
+	 *
+	 * @return Estimated fraction of segments lost (0 to 1).
+	 */
+	double get_loss_rate();
+
+	/**
+	 * Offers to resume an interrupted transfer, for a receiver that already
+	 * holds the first offset bytes of the data. This must be called before
+	 * accept_connection.
+	 *
+	 * The sender either accepts (see resume) and skips those bytes, or
+	 * starts over from the beginning; get_resume_offset says which.
+	 *
+	 * @param offset The number of bytes already held.
+	 * @param hash Hash of those bytes (see rdt_hash.h), which the sender
+	 * 		checks against its own data.
+	 */
+	void set_resume_offer(uint64_t offset, uint64_t hash);
+
+	/**
+	 * Returns where the received data starts: the offset of an accepted
+	 * resume offer, or 0 if the sender started over. This is only known
+	 * once a receive call has returned.
+	 *
+	 * @return Number of bytes of the data the sender skipped.
+	 */
+	uint64_t get_resume_offset();
+
+	/**
+	 * Returns the resume offer made by the remote host, if any, once
+	 * connect_to_remote has returned.
+	 *
+	 * @param offset Set to the number of bytes the remote host holds.
+	 * @param hash Set to the hash of those bytes.
+	 * @return true if an offer was made.
+	 */
+	bool get_resume_offer(uint64_t *offset, uint64_t *hash);
+
+	/**
+	 * Accepts the remote host's resume offer: data sent from now on follows
+	 * the bytes it already holds. This must be called before any data is
+	 * sent, and only after checking the offer's hash against those bytes.
+	 * Not calling it declines the offer.
+	 */
+	void resume();
+
+	/**
+	 * Corks or uncorks the socket. While corked, small writes passed to
+	 * send_data are coalesced into full segments instead of costing a
+	 * segment (and a round trip) each. Buffered data is sent once it fills
+	 * a segment, when flush or close_connection is called, or when it has
+	 * waited CORK_DELAY milliseconds.
+	 *
+	 * @note There is no timer thread: the delay is checked on each call to
+	 * send_data, so a producer that goes quiet should call flush.
+	 *
+	 * Uncorking flushes anything buffered.
+	 *
+	 * @param enable Whether to cork the socket.
+	 */
+	void set_cork(bool enable);
+
+	/**
+	 * Sends all data buffered by send_data right away: corked data, a
+	 * partial FEC group and, on a compressed connection, everything given
+	 * to the compressor so far (the receiver can decompress it all).
+	 */
+	void flush();
+
+	/**
+	 * Limits how fast this connection sends: data segments, including
+	 * retransmissions and FEC parity, take from a token bucket, while ACKs
+	 * and other control segments are never held back. After a burst of up
+	 * to burst_bytes, segments are paced out evenly at the limit rate rather
+	 * than in bursts, so a bulk transfer leaves room on the link for others.
+	 *
+	 * @param bytes_per_sec The limit, or 0 for none (the default).
+	 * @param burst_bytes The burst size, or 0 for RATE_BURST_MS ms worth of
+	 * 		data (but at least a segment).
+	 */
+	void set_rate_limit(uint64_t bytes_per_sec, int burst_bytes = 0);
+
+	/**
+	 * Limits how fast all the connections in this process send together,
+	 * on top of any limits of their own (see set_rate_limit). Connections
+	 * take turns under the limit in the order their segments come.
+	 *
+	 * @param bytes_per_sec The limit, or 0 for none (the default).
+	 * @param burst_bytes The burst size, or 0 as for set_rate_limit.
+	 */
+	static void set_global_rate_limit(uint64_t bytes_per_sec, int burst_bytes = 0);
+
 private:
 	// Private member variables are initialized in the constructor
 	int sock_fd;
-	uint32_t sequence_number;
-	uint32_t expected_sequence_number;
+	// The receive timeout last set (see set_timeout_length)
+	uint32_t timeout_length;
+	// Next sequence number we send, and the next one we expect to receive.
+	// Like TCP, sequence numbers count bytes of data, starting from each
+	// end's ISN. Only the low 32 bits are sent (see rdt_seq.h).
+	uint64_t sequence_number;
+	uint64_t expected_sequence_number;
 	int estimated_rtt;
 	int dev_rtt;
 	int current_rtt;
 	connection_status state;
 
+	// Why the connection failed (see get_error)
+	std::error_code error;
+
+	// The connection ID (see RDTHeader) and where the remote host is, which
+	// only changes once a path challenge (see check_path) to its new
+	// address is answered: the address, the challenge's random data and
+	// when it was last sent.
+	uint32_t connection_id;
+	int family;
+	struct sockaddr_storage peer_addr;
+	bool challenge_pending;
+	struct sockaddr_storage challenge_addr;
+	uint8_t challenge_data[8];
+	int challenge_sent;
+
 	// In the (unlikely?) event you need a new field, add it here.
 
+	// Options we offer (compression_enabled) and the ones that were agreed
+	// on for this connection (RDT_OPT_* flags)
+	bool compression_enabled;
+	uint32_t options;
+
+	// Pre-shared key (if have_psk) and, once connected, the encryption
+	// session; crypto is NULL for plaintext connections.
+	bool have_psk;
+	uint8_t psk[32];
+	CryptoSession *crypto;
+
+	// Secret the listener's SYN cookies are made with (see RDTCookieEcho)
+	uint8_t cookie_secret[32];
+
+	// This connection's rate limit (NULL if it has none) and the one for
+	// the whole process (see rdt_rate.h)
+	RateBucket *rate_limit;
+	static RateBucket *global_rate_limit;
+
+	// Compression state: the deflate stream and the segment it is filling
+	// (sender), and the inflate stream plus the segment it is reading from
+	// (receiver). The streams are created on first use.
+	z_stream_s *deflater;
+	std::vector<char> deflate_out;
+	int deflate_out_len;
+
+	// Adaptive compression: the current zlib level and what the current
+	// block of input has cost so far. Blocks compressing worse than
+	// COMPRESS_BYPASS_RATIO switch compression off for COMPRESS_PROBE_BLOCKS
+	// blocks.
+	static const int COMPRESS_BLOCK_SIZE = 64 * 1024;
+	static const int COMPRESS_PROBE_BLOCKS = 16;
+	static constexpr double COMPRESS_BYPASS_RATIO = 0.9;
+	int compress_level;
+	int compress_block_in;
+	int compress_block_out;
+	long long compress_block_nsec;
+	int compress_probe_countdown;
+	long long compress_total_in;
+	long long compress_total_out;
+	z_stream_s *inflater;
+	std::vector<char> inflate_in;
+	// Segment receive_some receives into before copying out
+	std::vector<char> recv_scratch;
+
+	// Buffers lent out by receive_loan (indexed by loan id) and the ids of
+	// the ones that are free again. loan_mutex guards loan_free, and
+	// loan_buffers growing, since loans may be released by other threads.
+	std::vector<std::vector<char>> loan_buffers;
+	std::vector<int> loan_free;
+	std::mutex loan_mutex;
+	bool inflate_more;
+
+	// Every segment of a message starts with a marker: MESSAGE_END if the
+	// message ends in this segment (MESSAGE_MORE if it goes on), plus
+	// MESSAGE_STREAM if the 16-bit stream it was queued on follows. Being
+	// part of the payload, it survives an FEC rebuild, which the header
+	// doesn't.
+	static const char MESSAGE_MORE = 0;
+	static const char MESSAGE_END = 1;
+	static const char MESSAGE_STREAM = 2;
+
+	// Messages queued on a stream (the first of them sent up to sent) and
+	// its schedule: priority, weight, and its deficit round robin credit in
+	// bytes. stream_mutex guards streams, which queue_message may update
+	// from any thread; drr_stream is the stream whose turn it is.
+	struct StreamQueue {
+		int priority = 0;
+		int weight = 1;
+		int deficit = 0;
+		std::deque<std::vector<char>> messages;
+		size_t sent = 0;
+	};
+	std::map<int, StreamQueue> streams;
+	std::mutex stream_mutex;
+	int drr_stream;
+
+	// Messages receive_message has only part of, by stream: the loan
+	// buffer they are collected in and where the message starts in it
+	struct PartialMessage {
+		int id;
+		int start;
+	};
+	std::map<int, PartialMessage> message_partials;
+
+	// Partial reliability: the limits (see send_message) on the message
+	// being sent, checked by give_up, and the streams the receiver has been
+	// told to skip a message on since receive_message last looked.
+	bool send_has_deadline;
+	int send_deadline;
+	int send_retransmits_left;
+	std::set<int> skipped_streams;
+
+	// Idle timeout and keepalive interval (see set_idle_timeout), and when
+	// we last received a segment from and sent one to the remote host.
+	int idle_timeout;
+	int keepalive_interval;
+	int last_heard;
+	int last_sent;
+
+	// Resuming: the offer the listener made (set by set_resume_offer, or
+	// received in the SYNACK), whether the listener is waiting to see if
+	// it was taken, and the offset the data starts from.
+	uint64_t resume_offer_offset;
+	uint64_t resume_offer_hash;
+	bool resume_pending;
+	uint64_t resume_offset;
+
+	// Sender side FEC state: group size and payloads waiting to be sent
+	int fec_group_size;
+	bool fec_auto;
+	std::vector<std::vector<char>> fec_pending;
+
+	// Moving average of the fraction of transmitted segments that were lost
+	double loss_rate;
+
+	// Receiver side FEC state for the group starting at
+	// expected_sequence_number,
+	// plus the last completed group so its ACK can be repeated.
+	int fec_recv_size;
+	uint32_t fec_recv_mask;
+	int fec_recv_count;
+	std::vector<char> fec_recv_payloads[MAX_FEC_GROUP];
+	std::vector<char> fec_recv_parity;
+	bool fec_have_parity;
+	int fec_parity_len_xor;
+	uint64_t fec_done_base;
+	int fec_done_size;
+
+	// Corking: data waiting to fill a segment, and whether (and since when,
+	// from current_msec) send_data has held back data for the peer.
+	bool corked;
+	std::vector<char> cork_buffer;
+	bool cork_pending;
+	int cork_start;
+
+	// In-order payloads ready to be handed to receive_data, including what
+	// is left of a payload that didn't fit the caller's buffer
+	std::deque<std::vector<char>> ready_segments;
+
 	/**
 	 * Sets the timeout length of this connection.
 	 *
@@ -135,7 +728,9 @@ private:
 	//@param sendSegement An array that stores the message we want to send
 	//@param recvSegement An array that stores the message we recieved
 	//@param senderSize the length of sendSegment
-	void send_seg_reliable(char sendSegment[MAX_SEG_SIZE] ,char recvSegment[MAX_SEG_SIZE] , int senderSize);
+	//@return false if it gave up on a partially reliable message (see
+	//give_up) instead of resending
+	bool send_seg_reliable(char sendSegment[MAX_SEG_SIZE] ,char recvSegment[MAX_SEG_SIZE] , int senderSize);
 
 	//first calls send then we want a timeout. if we do not timeout then send
 	//again
@@ -144,5 +739,292 @@ private:
 
 	void send_timeout(char sendSegment[MAX_SEG_SIZE]);
 
+	//Returns the RDT_OPT_* options this end is willing to use.
+	uint32_t offered_options();
+
+	//Returns which of the RDT_OPT_* options a remote host asked for we
+	//agree to.
+	uint32_t agreed_options(uint32_t requested);
+
+	//Appends the pre-shared key signature (if we have a key) to a SYN,
+	//SYNACK or cookie echo segment.
+	//
+	//@param segment The segment, with header and payload filled in
+	//@param length The length of the header and payload
+	//@return The length of the segment to send
+	int sign_handshake(char segment[MAX_SEG_SIZE],
+			int length = sizeof(RDTHeader) + sizeof(RDTHandshake));
+
+	//Checks the pre-shared key signature of a received SYN, SYNACK or
+	//cookie echo.
+	//
+	//@param segment The (zero padded) received segment
+	//@param length The length of the header and payload
+	//@return true if it was signed with our key
+	bool handshake_valid(char segment[MAX_SEG_SIZE],
+			int length = sizeof(RDTHeader) + sizeof(RDTHandshake));
+
+	//Answers a SYN with a SYNACK carrying a SYN cookie, keeping nothing.
+	//
+	//@param segment The SYN
+	//@param from The address it came from
+	void answer_syn(char segment[MAX_SEG_SIZE], const struct sockaddr_storage &from);
+
+	//Checks a cookie echo and, if its cookie is one we made recently for
+	//the address it came from, sets the connection up from it.
+	//
+	//@param segment The (zero padded) cookie echo
+	//@param from The address it came from
+	//@return true if the connection is now set up
+	bool accept_cookie(char segment[MAX_SEG_SIZE], const struct sockaddr_storage &from);
+
+	//Computes the SYN cookie for a SYN (or cookie echo, which starts the
+	//same way).
+	//
+	//@param segment The segment
+	//@param isn Our ISN for the connection
+	//@param from The address it came from
+	//@param slot The COOKIE_LIFETIME second time slot the cookie is for
+	//@param cookie Filled in with the cookie
+	void make_cookie(const char *segment, uint32_t isn,
+			const struct sockaddr_storage &from, uint64_t slot, uint8_t cookie[16]);
+
+	//Returns the largest payload that fits in a segment on this connection.
+	int max_payload();
+
+	//Sends a segment to the remote host, stamped with the connection ID
+	//(unless it already carries one, like a SYNACK answering a SYN) and
+	//encrypted if the connection is encrypted. Every segment we send goes
+	//through here.
+	//
+	//@param segment The segment to send
+	//@param length The length of the segment
+	//@param to Where to send it, if not to the remote host's address
+	//@return The result of sendmsg
+	int send_segment(const char *segment, int length,
+			const struct sockaddr_storage *to = NULL);
+
+	//Returns the burst size to use with a rate limit (see set_rate_limit).
+	static uint64_t rate_burst(uint64_t bytes_per_sec, int burst_bytes);
+
+	//Waits until a data segment may be sent under the rate limits (see
+	//set_rate_limit), taking its tokens.
+	//
+	//@param length The segment's length on the wire
+	void pace(int length);
+
+	//Receives a segment from the remote host (like recv, honouring the
+	//timeout). Segments for other connections, segments that fail to
+	//authenticate (on encrypted connections) and path validation segments
+	//are dealt with here, and the wait continues, but doesn't start over:
+	//a stream of them can't put off a timeout.
+	//
+	//@param segment Where the (decrypted) segment is stored
+	//@param from If not NULL, set to the address the segment came from
+	//@return The segment length, or -1 with errno set like recv
+	int recv_segment(char segment[MAX_SEG_SIZE],
+			struct sockaddr_storage *from = NULL);
+
+	//Sends our SYN to each of the remote host's addresses in turn (see
+	//connect_to_remote), resending to those already tried, until a SYNACK
+	//for it arrives. The address it came from becomes the remote host's.
+	//Addresses we can't send to at all are dropped from the race.
+	//
+	//@param syn The SYN segment
+	//@param syn_len The length of syn
+	//@param candidates The addresses to try, in order
+	//@param recvSegment Where the SYNACK is stored
+	//@return false if the connection failed, including when none of the
+	//addresses could be sent to
+	bool race_syn(const char *syn, int syn_len,
+			const std::vector<struct sockaddr_storage> &candidates,
+			char recvSegment[MAX_SEG_SIZE]);
+
+	//Path validation: answers the remote host's path challenges, switches
+	//to a new address once it answers ours, and challenges a new address
+	//segments arrive from. Segments from an unvalidated address are still
+	//used, but nothing is sent there until it answers, so a forged source
+	//address can't redirect the connection.
+	//
+	//@param segment A received (decrypted) segment
+	//@param length The length of segment
+	//@param from The address it came from
+	//@return false if the segment was for path validation only
+	bool check_path(char segment[MAX_SEG_SIZE], int length,
+			const struct sockaddr_storage &from);
+
+	//Splits data into segments and sends them with send_payload.
+	//
+	//@param data The data to send
+	//@param length The length of the data
+	void send_segments(const char *data, int length);
+
+	//Sends one segment's worth of data, either right away (see
+	//send_stop_and_wait) or, with FEC on, as part of a group.
+	//
+	//@param data The payload to send
+	//@param length The length of the payload (at most max_payload())
+	//@return false if a partially reliable message was given up on
+	bool send_payload(const void *data, int length);
+
+	//Sends one segment's worth of data and waits for it to be ACKed,
+	//resending as needed.
+	//
+	//@param data The payload to send
+	//@param length The length of the payload (at most max_payload(), and
+	//may be 0)
+	//@return false if a partially reliable message was given up on
+	bool send_stop_and_wait(const void *data, int length);
+
+	//Answers a segment that arrived while we were waiting for something
+	//else, if the remote host would otherwise keep resending it: a repeated
+	//cookie echo or data segment means our ACK for it was lost, which can
+	//happen just as the two ends swap roles.
+	//
+	//@param segment The received segment
+	void answer_stray(char segment[MAX_SEG_SIZE]);
+
+	//Works out, from the first data segment after the handshake, whether
+	//the sender took our resume offer.
+	//
+	//@param seq The segment's (unwrapped) sequence number
+	void check_resume(uint64_t seq);
+
+	//Copies the next in-order data into buffer: the rest of a payload,
+	//one more payload or, on compressed connections, one inflate call's
+	//worth of output.
+	//
+	//@param buffer Where the data is stored
+	//@param capacity The size of buffer
+	//@param block Whether to wait for the network if nothing is held yet
+	//@return The amount of data, 0 if the connection was closed, or -1 if
+	//block is false and nothing was ready
+	int receive_some(char *buffer, int capacity, bool block);
+
+	//Receives the next in-order segment payload. The segment is received
+	//straight into the given buffer (or traded for a buffer already holding
+	//the payload), so the payload is never copied.
+	//
+	//@param segment Buffer holding the payload on return (resized as needed)
+	//@param offset Set to where the payload starts in segment
+	//@return The length of the payload, or 0 if the connection was closed
+	int receive_payload(std::vector<char> &segment, int *offset);
+
+	//Runs the deflate stream over the given input, sending each segment it
+	//fills.
+	//
+	//@param data Input to compress (may be NULL if length is 0)
+	//@param length The length of the input
+	//@param flush The zlib flush mode (Z_NO_FLUSH, Z_FINISH, ...)
+	void deflate_and_send(const void *data, int length, int flush);
+
+	//Compresses one piece of input (that doesn't cross a block boundary)
+	//and sends any segments it fills, keeping track of the CPU time spent.
+	//
+	//@param data Input to compress
+	//@param length The length of the input
+	//@param flush The zlib flush mode
+	void deflate_chunk(const char *data, int length, int flush);
+
+	//Picks the compression level for the next block from how well, and how
+	//fast, the last block compressed compared to what the link can carry.
+	void tune_compression();
+
+	//Switches the deflate stream to a new level, sending any output this
+	//produces.
+	//
+	//@param level The new zlib compression level
+	void set_compression_level(int level);
+
+	//Frees the compression streams (if any).
+	void end_compression();
+
+	//Folds the outcome of some transmissions into the loss rate estimate.
+	//
+	//@param sent Number of segments sent
+	//@param lost How many of them were lost
+	void record_loss(int sent, int lost);
+
+	//Sends the buffered FEC group (data segments followed by the parity
+	//segment) and waits until the receiver has every segment, either
+	//received or rebuilt. Missing segments are resent as soon as a group ACK
+	//shows the receiver could not rebuild them, or after a timeout.
+	//
+	//@return false if a partially reliable message was given up on, in
+	//which case the group is dropped
+	bool send_fec_group();
+
+	//Checks whether to give up on the partially reliable message being
+	//sent: once its deadline has passed or, before a retransmission, once
+	//it has used up its retransmissions. Always false for other data.
+	//
+	//@param retransmit Whether we are about to retransmit (which this
+	//counts)
+	bool give_up(bool retransmit);
+
+	//Shortens a wait so it ends by the deadline of the partially reliable
+	//message being sent, if there is one, or when the connection would
+	//time out or (for a wait with no limit) a keepalive probe is due.
+	//
+	//@param timeout The wait in milliseconds, or 0 for no limit
+	//@return The wait to use (at least 1 ms, or 0 for no limit)
+	uint32_t cap_wait(uint32_t timeout);
+
+	//Called when a wait on the remote host times out: drops the connection
+	//if the idle timeout has passed, or else sends a keepalive probe if
+	//one is due.
+	//
+	//@return false if the connection has timed out
+	bool peer_alive();
+
+	//Fails the connection: records the error and gives up on anything
+	//still waiting to be sent.
+	//
+	//@param error_number The errno value describing the failure
+	void fail(int error_number);
+
+	//Sends a keepalive segment.
+	//
+	//@param reply Whether this answers the remote host's probe
+	void send_keepalive(bool reply);
+
+	//Tells the receiver that the data up to target was given up on, so it
+	//should carry on from there, and waits for it to agree.
+	//
+	//@param target Sequence number just past the abandoned message
+	//@param stream The stream the abandoned message was on
+	void send_skip(uint64_t target, int stream);
+
+	//Handles an FEC data or parity segment on the receiving side, rebuilding
+	//a lost segment from parity when possible. Once the group is complete its
+	//payloads are queued in ready_segments.
+	//
+	//@param segment The received segment
+	//@param length The length of segment
+	void recv_fec_segment(char segment[MAX_SEG_SIZE], int length);
+
+	//Picks the stream the next queued segment comes from: the stream whose
+	//turn it is among those with the highest priority and messages
+	//queued. Call with stream_mutex held.
+	//
+	//@return The stream, or -1 if nothing is queued
+	int next_stream();
+
+	//Gives up on the messages receive_message has only part of.
+	//
+	//@param stream The stream to give up on, or -1 for all of them
+	void drop_partials(int stream = -1);
+
+	//Takes a buffer from the loan pool, growing the pool if they are all
+	//lent out.
+	//
+	//@return The buffer's loan id
+	int borrow_buffer();
+
+	//Sends a group ACK listing which segments of a group we hold.
+	//
+	//@param base Sequence number of the first segment in the group
+	//@param mask Bitmap of held segments (plus FEC_PARITY_SEEN)
+	void send_group_ack(uint64_t base, uint32_t mask);
 
 };
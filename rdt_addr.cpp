@@ -0,0 +1,122 @@
+/*
+ * File: rdt_addr.cpp
+ *
+ * Implementation of socket address handling for the RDT library.
+ *
+ */
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "rdt_addr.h"
+
+bool addr_equal(const struct sockaddr_storage &a, const struct sockaddr_storage &b) {
+	if (a.ss_family != b.ss_family) {
+		return false;
+	}
+	if (a.ss_family == AF_INET) {
+		const struct sockaddr_in *a4 = (const struct sockaddr_in*)&a;
+		const struct sockaddr_in *b4 = (const struct sockaddr_in*)&b;
+		return a4->sin_port == b4->sin_port
+			&& a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	}
+	if (a.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6*)&a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6*)&b;
+		return a6->sin6_port == b6->sin6_port
+			&& memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+	}
+	return false;
+}
+
+socklen_t addr_length(const struct sockaddr_storage &addr) {
+	if (addr.ss_family == AF_INET6) {
+		return sizeof(struct sockaddr_in6);
+	}
+	return sizeof(struct sockaddr_in);
+}
+
+std::string addr_to_string(const struct sockaddr_storage &addr) {
+	char host[INET6_ADDRSTRLEN] = "?";
+	int port = 0;
+	if (addr.ss_family == AF_INET) {
+		const struct sockaddr_in *a4 = (const struct sockaddr_in*)&addr;
+		inet_ntop(AF_INET, &a4->sin_addr, host, sizeof(host));
+		port = ntohs(a4->sin_port);
+	}
+	else if (addr.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6*)&addr;
+		inet_ntop(AF_INET6, &a6->sin6_addr, host, sizeof(host));
+		return "[" + std::string(host) + "]:" + std::to_string(ntohs(a6->sin6_port));
+	}
+	return std::string(host) + ":" + std::to_string(port);
+}
+
+int addr_resolve(const char *host, int port, int family,
+		std::vector<struct sockaddr_storage> &candidates) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = (family == AF_INET6) ? AF_UNSPEC : AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	struct addrinfo *results;
+	int error = getaddrinfo(host, std::to_string(port).c_str(), &hints, &results);
+	if (error != 0) {
+		return error;
+	}
+
+	// Split by family, keeping the resolver's order within each
+	std::vector<struct sockaddr_storage> by_family[2];
+	int first_family = 0;
+	for (struct addrinfo *ai = results; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) {
+			continue;
+		}
+		struct sockaddr_storage addr;
+		memset(&addr, 0, sizeof(addr));
+		memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+		if (ai->ai_family == AF_INET && family == AF_INET6) {
+			// A dual-stack socket reaches IPv4 hosts at IPv4-mapped addresses
+			struct sockaddr_in v4 = *(struct sockaddr_in*)ai->ai_addr;
+			struct sockaddr_in6 *v6 = (struct sockaddr_in6*)&addr;
+			memset(&addr, 0, sizeof(addr));
+			v6->sin6_family = AF_INET6;
+			v6->sin6_port = v4.sin_port;
+			v6->sin6_addr.s6_addr[10] = 0xff;
+			v6->sin6_addr.s6_addr[11] = 0xff;
+			memcpy(&v6->sin6_addr.s6_addr[12], &v4.sin_addr, 4);
+		}
+		if (by_family[0].empty() && by_family[1].empty()) {
+			first_family = ai->ai_family;
+		}
+		by_family[ai->ai_family == first_family ? 0 : 1].push_back(addr);
+	}
+	freeaddrinfo(results);
+
+	candidates.clear();
+	for (size_t i = 0; i < by_family[0].size() || i < by_family[1].size(); i++) {
+		for (int f = 0; f < 2; f++) {
+			if (i < by_family[f].size()) {
+				candidates.push_back(by_family[f][i]);
+			}
+		}
+	}
+	return candidates.empty() ? EAI_NONAME : 0;
+}
+
+void addr_any(int family, int port, struct sockaddr_storage &addr) {
+	memset(&addr, 0, sizeof(addr));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *v6 = (struct sockaddr_in6*)&addr;
+		v6->sin6_family = AF_INET6;
+		v6->sin6_addr = in6addr_any;
+		v6->sin6_port = htons(port);
+	}
+	else {
+		struct sockaddr_in *v4 = (struct sockaddr_in*)&addr;
+		v4->sin_family = AF_INET;
+		v4->sin_addr.s_addr = INADDR_ANY;
+		v4->sin_port = htons(port);
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * File: rdt_addr.h
+ *
+ * Header / API file for handling socket addresses in the RDT library.
+ *
+ * A connection is identified by its connection ID rather than by the
+ * addresses of its ends, so the remote host's address is kept as a value
+ * that can change during the connection (see ReliableSocket::check_path).
+ */
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+/*
+ * Checks whether two addresses are the same (family, address and port).
+ */
+bool addr_equal(const struct sockaddr_storage &a, const struct sockaddr_storage &b);
+
+/*
+ * Returns the length of the sockaddr held in an address, as sendto wants it.
+ */
+socklen_t addr_length(const struct sockaddr_storage &addr);
+
+/*
+ * Formats an address as host:port, for log messages.
+ */
+std::string addr_to_string(const struct sockaddr_storage &addr);
+
+/*
+ * Resolves a host name or address literal (IPv4 or IPv6) to the addresses
+ * to try connecting to, in the order happy eyeballs (RFC 8305) tries them:
+ * address families alternate, starting with the one the resolver prefers.
+ *
+ * @param host The host name or address.
+ * @param port The port number.
+ * @param family The family of the socket that will be used: with AF_INET6
+ * 	(a dual-stack socket) IPv4 addresses are given as IPv4-mapped IPv6
+ * 	addresses, and with AF_INET only IPv4 addresses are looked up.
+ * @param candidates Filled with the addresses.
+ * @return 0, or a getaddrinfo error code (see gai_strerror).
+ */
+int addr_resolve(const char *host, int port, int family,
+		std::vector<struct sockaddr_storage> &candidates);
+
+/*
+ * Fills in the wildcard address of a family (e.g. for bind), with a port.
+ */
+void addr_any(int family, int port, struct sockaddr_storage &addr);
@@ -0,0 +1,58 @@
+/*
+ * File: rdt_batch.cpp
+ *
+ * Reliable data transport (RDT) multi-file framing implementation.
+ *
+ */
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "rdt_batch.h"
+
+int batch_pack_header(char *out, const char *name, uint64_t size, uint32_t mode) {
+	int name_length = strlen(name);
+	uint32_t size_high = htonl((uint32_t)(size >> 32));
+	uint32_t size_low = htonl((uint32_t)size);
+	uint32_t mode_net = htonl(mode);
+	uint16_t name_length_net = htons(name_length);
+
+	memcpy(out, &size_high, 4);
+	memcpy(out + 4, &size_low, 4);
+	memcpy(out + 8, &mode_net, 4);
+	memcpy(out + 12, &name_length_net, 2);
+	memcpy(out + BATCH_HEADER_SIZE, name, name_length);
+	return BATCH_HEADER_SIZE + name_length;
+}
+
+void batch_parse_header(const char header[BATCH_HEADER_SIZE], uint64_t *size,
+		uint32_t *mode, int *name_length) {
+	uint32_t size_high, size_low, mode_net;
+	uint16_t name_length_net;
+	memcpy(&size_high, header, 4);
+	memcpy(&size_low, header + 4, 4);
+	memcpy(&mode_net, header + 8, 4);
+	memcpy(&name_length_net, header + 12, 2);
+
+	*size = ((uint64_t)ntohl(size_high) << 32) | ntohl(size_low);
+	*mode = ntohl(mode_net);
+	*name_length = ntohs(name_length_net);
+}
+
+bool batch_name_safe(const char *name) {
+	if (name[0] == '\0' || name[0] == '/') {
+		return false;
+	}
+	// Look at each '/' separated component
+	const char *component = name;
+	while (1) {
+		const char *end = strchr(component, '/');
+		int length = end ? end - component : strlen(component);
+		if (length == 2 && component[0] == '.' && component[1] == '.') {
+			return false;
+		}
+		if (end == NULL) {
+			return true;
+		}
+		component = end + 1;
+	}
+}
@@ -0,0 +1,47 @@
+/*
+ * File: rdt_batch.h
+ *
+ * Header / API file for the framing used to send many files over one
+ * connection (sender -b, receiver -d).
+ *
+ * The stream is a series of files, each a header (BATCH_HEADER_SIZE bytes:
+ * 64-bit size, 32-bit mode and 16-bit name length, all in network byte
+ * order) followed by the name and then size bytes of contents. The stream
+ * ends with the connection. Names are relative paths using '/'.
+ */
+#include <stdint.h>
+
+const int BATCH_HEADER_SIZE = 8 + 4 + 2;
+const int BATCH_MAX_NAME = 4096;
+
+/*
+ * Writes the header and name that go in front of a file's contents.
+ *
+ * @param out Where to write (at least BATCH_HEADER_SIZE + the name's length
+ * 		bytes).
+ * @param name Name of the file (at most BATCH_MAX_NAME bytes).
+ * @param size Size of the file's contents.
+ * @param mode The file's permission bits.
+ * @return The number of bytes written.
+ */
+int batch_pack_header(char *out, const char *name, uint64_t size, uint32_t mode);
+
+/*
+ * Reads a file header.
+ *
+ * @param header The BATCH_HEADER_SIZE header bytes.
+ * @param size Set to the size of the file's contents.
+ * @param mode Set to the file's permission bits.
+ * @param name_length Set to the length of the name that follows.
+ */
+void batch_parse_header(const char header[BATCH_HEADER_SIZE], uint64_t *size,
+		uint32_t *mode, int *name_length);
+
+/*
+ * Checks that a received name stays inside the destination directory: it
+ * must be relative, non-empty and free of ".." components.
+ *
+ * @param name The name to check.
+ * @return true if the name is safe to use.
+ */
+bool batch_name_safe(const char *name);
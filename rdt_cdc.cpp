@@ -0,0 +1,165 @@
+/*
+ * File: rdt_cdc.cpp
+ *
+ * Reliable data transport (RDT) content-defined chunking and chunk store
+ * implementation.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+
+#include "rdt_cdc.h"
+
+// Spread-out masks from the FastCDC paper. Boundaries are harder to hit
+// (15 bits) before the average chunk size and easier (11 bits) after it,
+// which keeps chunk sizes close to the average.
+static const uint64_t MASK_HARD = 0x0003590703530000ULL;
+static const uint64_t MASK_EASY = 0x0000d90003530000ULL;
+
+/*
+ * The gear table: a fixed pseudo-random 64-bit value per byte. Both ends
+ * only need to agree on it, so it is generated (by splitmix64) rather than
+ * spelled out.
+ */
+static const uint64_t *gear_table() {
+	static struct GearTable {
+		uint64_t values[256];
+		GearTable() {
+			uint64_t state = 0x5244544344430000ULL;
+			for (int i = 0; i < 256; i++) {
+				uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				values[i] = z ^ (z >> 31);
+			}
+		}
+	} table;
+	return table.values;
+}
+
+size_t cdc_cut(const char *data, size_t length) {
+	if (length <= (size_t)CDC_MIN_CHUNK) {
+		return length;
+	}
+	if (length > (size_t)CDC_MAX_CHUNK) {
+		length = CDC_MAX_CHUNK;
+	}
+	size_t normal = length < (size_t)CDC_AVG_CHUNK ? length : CDC_AVG_CHUNK;
+
+	const uint64_t *gear = gear_table();
+	const uint8_t *bytes = (const uint8_t*)data;
+	uint64_t fingerprint = 0;
+	size_t i = CDC_MIN_CHUNK;
+	for (; i < normal; i++) {
+		fingerprint = (fingerprint << 1) + gear[bytes[i]];
+		if ((fingerprint & MASK_HARD) == 0) {
+			return i + 1;
+		}
+	}
+	for (; i < length; i++) {
+		fingerprint = (fingerprint << 1) + gear[bytes[i]];
+		if ((fingerprint & MASK_EASY) == 0) {
+			return i + 1;
+		}
+	}
+	return length;
+}
+
+void cdc_hash(const char *data, size_t length, uint8_t hash[CDC_HASH_SIZE]) {
+	unsigned int hash_len;
+	EVP_Digest(data, length, hash, &hash_len, EVP_sha256(), NULL);
+}
+
+/*
+ * Where a chunk is kept: under a directory named by the first byte of its
+ * hash, so no one directory grows too large.
+ */
+static std::string chunk_path(const std::string &store,
+		const uint8_t hash[CDC_HASH_SIZE], bool make_dir) {
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (int i = 0; i < CDC_HASH_SIZE; i++) {
+		hex += digits[hash[i] >> 4];
+		hex += digits[hash[i] & 15];
+	}
+	std::string dir = store + "/" + hex.substr(0, 2);
+	if (make_dir) {
+		mkdir(dir.c_str(), 0755); // may well exist already
+	}
+	return dir + "/" + hex.substr(2);
+}
+
+bool cdc_store_has(const std::string &store, const uint8_t hash[CDC_HASH_SIZE]) {
+	return access(chunk_path(store, hash, false).c_str(), F_OK) == 0;
+}
+
+bool cdc_store_get(const std::string &store, const uint8_t hash[CDC_HASH_SIZE],
+		std::vector<char> &chunk) {
+	int fd = open(chunk_path(store, hash, false).c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	chunk.resize(CDC_MAX_CHUNK + 1);
+	size_t length = 0;
+	while (length < chunk.size()) {
+		ssize_t n = read(fd, chunk.data() + length, chunk.size() - length);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		length += n;
+	}
+	close(fd);
+	chunk.resize(length);
+
+	// A chunk left damaged by a crash must not be passed off as the real one
+	uint8_t actual[CDC_HASH_SIZE];
+	cdc_hash(chunk.data(), chunk.size(), actual);
+	return memcmp(actual, hash, CDC_HASH_SIZE) == 0;
+}
+
+bool cdc_store_put(const std::string &store, const uint8_t hash[CDC_HASH_SIZE],
+		const char *data, size_t length) {
+	std::string path = chunk_path(store, hash, true);
+	if (access(path.c_str(), F_OK) == 0) {
+		return true; // already stored, perhaps by another receiver
+	}
+	// Each writer gets its own temporary file, so receivers sharing a
+	// store never write into each other's
+	std::string temp = path + ".XXXXXX";
+	int fd = mkstemp(&temp[0]);
+	if (fd < 0) {
+		return false;
+	}
+	fchmod(fd, 0644);
+	while (length > 0) {
+		ssize_t n = write(fd, data, length);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			int saved = errno;
+			close(fd);
+			unlink(temp.c_str());
+			errno = saved;
+			return false;
+		}
+		data += n;
+		length -= n;
+	}
+	if (close(fd) < 0 || rename(temp.c_str(), path.c_str()) < 0) {
+		int saved = errno;
+		unlink(temp.c_str());
+		errno = saved;
+		return false;
+	}
+	return true;
+}
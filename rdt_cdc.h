@@ -0,0 +1,76 @@
+/*
+ * File: rdt_cdc.h
+ *
+ * Header / API file for deduplicated transfers (sender -c, receiver -c),
+ * which don't resend data the receiver already holds from earlier
+ * transfers.
+ *
+ * The sender cuts its data into content-defined chunks (FastCDC): chunk
+ * boundaries depend only on the bytes near them, so an insertion or removal
+ * moves the boundaries around it but not elsewhere, and the same content
+ * yields the same chunks wherever it turns up. Chunks are named by their
+ * SHA-256 hash. The receiver keeps every chunk it sees in a store directory
+ * and writes its output from them.
+ *
+ * The sender works through its data in batches of up to CDC_QUERY_CHUNKS
+ * chunks. For each batch it sends CDC_QUERY, a 32-bit chunk count and the
+ * chunk hashes; the receiver answers with a bitmap (bit i, least
+ * significant first, set if it holds chunk i). The sender then sends, for
+ * each chunk, CDC_REF if the receiver holds it, or CDC_DATA, a 32-bit length
+ * and the bytes. CDC_END, the 64-bit length and hash (see rdt_hash.h) of
+ * all the data ends the stream. Integers are in network byte order.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+const int CDC_MIN_CHUNK = 2 * 1024;
+const int CDC_AVG_CHUNK = 8 * 1024;
+const int CDC_MAX_CHUNK = 64 * 1024;
+const int CDC_HASH_SIZE = 32;
+const int CDC_QUERY_CHUNKS = 1024;
+
+enum CdcOp : uint8_t { CDC_QUERY = 'Q', CDC_REF = 'R', CDC_DATA = 'D', CDC_END = 'E' };
+
+/*
+ * Finds where the first chunk of some data ends.
+ *
+ * @param data The data.
+ * @param length Length of data, which must be at least CDC_MAX_CHUNK unless
+ * 	data runs to the end of the input.
+ * @return Length of the first chunk.
+ */
+size_t cdc_cut(const char *data, size_t length);
+
+/*
+ * Computes the hash that names a chunk.
+ */
+void cdc_hash(const char *data, size_t length, uint8_t hash[CDC_HASH_SIZE]);
+
+/*
+ * Checks whether a chunk is in the store.
+ *
+ * @param store Directory holding the chunks.
+ * @param hash Hash of the chunk.
+ */
+bool cdc_store_has(const std::string &store, const uint8_t hash[CDC_HASH_SIZE]);
+
+/*
+ * Reads a chunk from the store.
+ *
+ * @param chunk Filled with the chunk.
+ * @return false if the chunk isn't in the store (or can't be read).
+ */
+bool cdc_store_get(const std::string &store, const uint8_t hash[CDC_HASH_SIZE],
+		std::vector<char> &chunk);
+
+/*
+ * Adds a chunk to the store, unless it is already there. The chunk only
+ * appears under its name once it is completely written, and receivers
+ * sharing a store can add chunks at the same time.
+ *
+ * @return false (with errno set) if the chunk couldn't be saved.
+ */
+bool cdc_store_put(const std::string &store, const uint8_t hash[CDC_HASH_SIZE],
+		const char *data, size_t length);
@@ -0,0 +1,224 @@
+/*
+ * File: rdt_crypto.cpp
+ *
+ * Reliable data transport (RDT) encryption implementation, using OpenSSL's
+ * libcrypto.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "rdt_crypto.h"
+
+// How far behind the newest counter a segment may arrive and still be
+// accepted (as long as that counter hasn't been seen already).
+static const int REPLAY_WINDOW = 64;
+
+struct CryptoSession {
+	EVP_CIPHER_CTX *seal_ctx;
+	EVP_CIPHER_CTX *open_ctx;
+	uint64_t send_counter;
+	uint64_t recv_highest;
+	uint64_t recv_window; // bit i set: counter recv_highest - i was seen
+	bool recv_any;
+};
+
+static int hex_value(int c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+bool crypto_load_key(const char *path, uint8_t key[CRYPTO_KEY_SIZE]) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("crypto_load_key fopen");
+		return false;
+	}
+	char hex[2 * CRYPTO_KEY_SIZE];
+	size_t got = fread(hex, 1, sizeof(hex), f);
+	fclose(f);
+	if (got != sizeof(hex)) {
+		return false;
+	}
+	for (int i = 0; i < CRYPTO_KEY_SIZE; i++) {
+		int hi = hex_value(hex[2*i]);
+		int lo = hex_value(hex[2*i + 1]);
+		if (hi < 0 || lo < 0) {
+			return false;
+		}
+		key[i] = (hi << 4) | lo;
+	}
+	return true;
+}
+
+bool crypto_random(void *buf, size_t len) {
+	if (RAND_bytes((unsigned char*)buf, len) != 1) {
+		fprintf(stderr, "ERROR: RAND_bytes failed\n");
+		return false;
+	}
+	return true;
+}
+
+void crypto_handshake_tag(const uint8_t psk[CRYPTO_KEY_SIZE], const void *data,
+		size_t len, uint8_t tag[CRYPTO_TAG_SIZE]) {
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned int mac_len = 0;
+	HMAC(EVP_sha256(), psk, CRYPTO_KEY_SIZE, (const unsigned char*)data, len,
+			mac, &mac_len);
+	memcpy(tag, mac, CRYPTO_TAG_SIZE);
+}
+
+bool crypto_handshake_verify(const uint8_t psk[CRYPTO_KEY_SIZE],
+		const void *data, size_t len, const uint8_t tag[CRYPTO_TAG_SIZE]) {
+	uint8_t expected[CRYPTO_TAG_SIZE];
+	crypto_handshake_tag(psk, data, len, expected);
+	return CRYPTO_memcmp(expected, tag, CRYPTO_TAG_SIZE) == 0;
+}
+
+bool crypto_equal(const void *a, const void *b, size_t len) {
+	return CRYPTO_memcmp(a, b, len) == 0;
+}
+
+// Derives one direction's key: HMAC-SHA256(psk, label || nonces).
+static void derive_key(const uint8_t psk[CRYPTO_KEY_SIZE], const char *label,
+		const uint8_t client_nonce[CRYPTO_NONCE_SIZE],
+		const uint8_t server_nonce[CRYPTO_NONCE_SIZE],
+		uint8_t key[CRYPTO_KEY_SIZE]) {
+	uint8_t input[8 + 2 * CRYPTO_NONCE_SIZE];
+	memcpy(input, label, 8);
+	memcpy(input + 8, client_nonce, CRYPTO_NONCE_SIZE);
+	memcpy(input + 8 + CRYPTO_NONCE_SIZE, server_nonce, CRYPTO_NONCE_SIZE);
+
+	unsigned int key_len = 0;
+	HMAC(EVP_sha256(), psk, CRYPTO_KEY_SIZE, input, sizeof(input), key, &key_len);
+}
+
+static EVP_CIPHER_CTX *new_gcm_ctx(const uint8_t key[CRYPTO_KEY_SIZE], bool encrypt) {
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL || EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, NULL,
+				encrypt ? 1 : 0) != 1) {
+		fprintf(stderr, "ERROR: Could not set up AES-256-GCM\n");
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+CryptoSession *crypto_session_new(const uint8_t psk[CRYPTO_KEY_SIZE],
+		const uint8_t client_nonce[CRYPTO_NONCE_SIZE],
+		const uint8_t server_nonce[CRYPTO_NONCE_SIZE], bool is_client) {
+	uint8_t c2s[CRYPTO_KEY_SIZE];
+	uint8_t s2c[CRYPTO_KEY_SIZE];
+	derive_key(psk, "rdt c2s ", client_nonce, server_nonce, c2s);
+	derive_key(psk, "rdt s2c ", client_nonce, server_nonce, s2c);
+
+	CryptoSession *session = new CryptoSession();
+	session->seal_ctx = new_gcm_ctx(is_client ? c2s : s2c, true);
+	session->open_ctx = new_gcm_ctx(is_client ? s2c : c2s, false);
+	session->send_counter = 0;
+	session->recv_highest = 0;
+	session->recv_window = 0;
+	session->recv_any = false;
+
+	OPENSSL_cleanse(c2s, sizeof(c2s));
+	OPENSSL_cleanse(s2c, sizeof(s2c));
+	if (session->seal_ctx == NULL || session->open_ctx == NULL) {
+		crypto_session_free(session);
+		return NULL;
+	}
+	return session;
+}
+
+void crypto_session_free(CryptoSession *session) {
+	if (session == NULL) {
+		return;
+	}
+	EVP_CIPHER_CTX_free(session->seal_ctx);
+	EVP_CIPHER_CTX_free(session->open_ctx);
+	delete session;
+}
+
+// The 96-bit GCM nonce is 4 zero bytes followed by the big-endian counter.
+static void make_iv(const uint8_t counter[8], uint8_t iv[12]) {
+	memset(iv, 0, 4);
+	memcpy(iv + 4, counter, 8);
+}
+
+int crypto_seal(CryptoSession *session, char *segment, int header_len, int length) {
+	uint8_t *counter = (uint8_t*)segment + length;
+	uint8_t *tag = counter + 8;
+	uint64_t n = session->send_counter++;
+	for (int i = 7; i >= 0; i--) {
+		counter[i] = n & 0xFF;
+		n >>= 8;
+	}
+
+	uint8_t iv[12];
+	make_iv(counter, iv);
+	EVP_CIPHER_CTX *ctx = session->seal_ctx;
+	unsigned char *payload = (unsigned char*)segment + header_len;
+	int out_len = 0;
+	EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv);
+	EVP_EncryptUpdate(ctx, NULL, &out_len, (unsigned char*)segment, header_len);
+	EVP_EncryptUpdate(ctx, NULL, &out_len, counter, 8);
+	EVP_EncryptUpdate(ctx, payload, &out_len, payload, length - header_len);
+	EVP_EncryptFinal_ex(ctx, payload + out_len, &out_len);
+	EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CRYPTO_TAG_SIZE, tag);
+	return length + CRYPTO_OVERHEAD;
+}
+
+int crypto_open(CryptoSession *session, char *segment, int header_len, int length) {
+	int plain_len = length - CRYPTO_OVERHEAD;
+	if (plain_len < header_len) {
+		return -1;
+	}
+	uint8_t *counter = (uint8_t*)segment + plain_len;
+	uint8_t *tag = counter + 8;
+	uint64_t n = 0;
+	for (int i = 0; i < 8; i++) {
+		n = (n << 8) | counter[i];
+	}
+
+	// Cheap replay check first; the window is only updated once the
+	// segment has been authenticated.
+	if (session->recv_any && n <= session->recv_highest) {
+		uint64_t age = session->recv_highest - n;
+		if (age >= REPLAY_WINDOW || (session->recv_window & (1ULL << age))) {
+			return -1;
+		}
+	}
+
+	uint8_t iv[12];
+	make_iv(counter, iv);
+	EVP_CIPHER_CTX *ctx = session->open_ctx;
+	unsigned char *payload = (unsigned char*)segment + header_len;
+	int out_len = 0;
+	EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv);
+	EVP_DecryptUpdate(ctx, NULL, &out_len, (unsigned char*)segment, header_len);
+	EVP_DecryptUpdate(ctx, NULL, &out_len, counter, 8);
+	EVP_DecryptUpdate(ctx, payload, &out_len, payload, plain_len - header_len);
+	EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, CRYPTO_TAG_SIZE, tag);
+	if (EVP_DecryptFinal_ex(ctx, payload + out_len, &out_len) != 1) {
+		return -1;
+	}
+
+	if (!session->recv_any || n > session->recv_highest) {
+		uint64_t shift = session->recv_any ? n - session->recv_highest : 0;
+		session->recv_window = (shift >= REPLAY_WINDOW) ? 0 : session->recv_window << shift;
+		session->recv_window |= 1;
+		session->recv_highest = n;
+		session->recv_any = true;
+	}
+	else {
+		session->recv_window |= 1ULL << (session->recv_highest - n);
+	}
+	return plain_len;
+}
@@ -0,0 +1,114 @@
+/*
+ * File: rdt_crypto.h
+ *
+ * Header / API file for the encryption component of the RDT library.
+ *
+ * Segments are protected with AES-256-GCM (OpenSSL picks AES-NI/VAES code
+ * when the CPU has it). The header is authenticated but left readable, and
+ * the payload is encrypted in place and followed by a trailer holding the
+ * 64-bit packet counter used as the nonce and the 16-byte tag.
+ *
+ * Both directions of a connection use their own key, derived from a
+ * pre-shared key and random nonces exchanged in the handshake, so a key/nonce
+ * pair is never reused even though each connection's counters start at 0.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+const int CRYPTO_KEY_SIZE = 32;
+const int CRYPTO_NONCE_SIZE = 16;
+const int CRYPTO_TAG_SIZE = 16;
+const int CRYPTO_OVERHEAD = 8 + CRYPTO_TAG_SIZE;
+
+// Per-connection encryption state (opaque)
+struct CryptoSession;
+
+/*
+ * Reads a pre-shared key from a file holding it as 64 hex digits (e.g. made
+ * with "openssl rand -hex 32 > keyfile").
+ *
+ * @param path Name of the key file.
+ * @param key Filled in with the key.
+ * @return true if a key was read, false otherwise.
+ */
+bool crypto_load_key(const char *path, uint8_t key[CRYPTO_KEY_SIZE]);
+
+/*
+ * Fills a buffer with cryptographically secure random bytes.
+ *
+ * @return false if no random bytes could be had.
+ */
+bool crypto_random(void *buf, size_t len);
+
+/*
+ * Computes the tag that authenticates a handshake segment under the
+ * pre-shared key (truncated HMAC-SHA256).
+ *
+ * @param psk The pre-shared key.
+ * @param data The segment (header and handshake payload).
+ * @param len Length of data.
+ * @param tag Filled in with the tag.
+ */
+void crypto_handshake_tag(const uint8_t psk[CRYPTO_KEY_SIZE], const void *data,
+		size_t len, uint8_t tag[CRYPTO_TAG_SIZE]);
+
+/*
+ * Checks the tag of a handshake segment, in constant time.
+ *
+ * @return true if the tag is valid.
+ */
+bool crypto_handshake_verify(const uint8_t psk[CRYPTO_KEY_SIZE],
+		const void *data, size_t len, const uint8_t tag[CRYPTO_TAG_SIZE]);
+
+/*
+ * Compares two buffers in constant time, so how long it takes gives away
+ * nothing about where they differ (e.g. for checking a MAC).
+ *
+ * @return true if they are equal.
+ */
+bool crypto_equal(const void *a, const void *b, size_t len);
+
+/*
+ * Derives the session keys for a connection.
+ *
+ * @param psk The pre-shared key.
+ * @param client_nonce Nonce sent by the initiator in its RDT_SYN.
+ * @param server_nonce Nonce sent by the listener in its RDT_SYNACK.
+ * @param is_client Whether we are the initiator.
+ * @return The new session, to be freed with crypto_session_free, or NULL if
+ * 		the cipher couldn't be set up.
+ */
+CryptoSession *crypto_session_new(const uint8_t psk[CRYPTO_KEY_SIZE],
+		const uint8_t client_nonce[CRYPTO_NONCE_SIZE],
+		const uint8_t server_nonce[CRYPTO_NONCE_SIZE], bool is_client);
+
+/*
+ * Frees a session (NULL is allowed).
+ */
+void crypto_session_free(CryptoSession *session);
+
+/*
+ * Encrypts a segment in place and appends its trailer.
+ *
+ * @note The buffer must have room for CRYPTO_OVERHEAD more bytes.
+ *
+ * @param session The connection's session.
+ * @param segment The segment to seal.
+ * @param header_len Length of the header (authenticated, not encrypted).
+ * @param length Length of the segment (header and payload).
+ * @return The sealed length (length + CRYPTO_OVERHEAD).
+ */
+int crypto_seal(CryptoSession *session, char *segment, int header_len, int length);
+
+/*
+ * Authenticates and decrypts a sealed segment in place, rejecting replayed
+ * segments.
+ *
+ * @param session The connection's session.
+ * @param segment The segment to open.
+ * @param header_len Length of the header.
+ * @param length Length of the sealed segment.
+ * @return The plaintext length (without the trailer), or -1 if the segment
+ * is forged, corrupted or a replay.
+ */
+int crypto_open(CryptoSession *session, char *segment, int header_len, int length);
@@ -0,0 +1,199 @@
+/*
+ * File: rdt_delta.cpp
+ *
+ * Reliable data transport (RDT) delta transfer implementation.
+ *
+ */
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <unordered_map>
+
+#include <openssl/evp.h>
+
+#include "rdt_delta.h"
+#include "rdt_hash.h"
+
+int delta_block_size(uint64_t length) {
+	int size = (int)sqrt((double)length);
+	size = (size + 63) & ~63;
+	if (size < 512) {
+		return 512;
+	}
+	if (size > 64 * 1024) {
+		return 64 * 1024;
+	}
+	return size;
+}
+
+uint32_t delta_weak_sum(const char *data, int length) {
+	// As in rsync: a is the sum of the bytes, b weights each byte by its
+	// distance from the end, both mod 2^16.
+	const uint8_t *bytes = (const uint8_t*)data;
+	uint32_t a = 0, b = 0;
+	for (int i = 0; i < length; i++) {
+		a += bytes[i];
+		b += (uint32_t)(length - i) * bytes[i];
+	}
+	return ((b & 0xffff) << 16) | (a & 0xffff);
+}
+
+uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, int length) {
+	uint32_t a = weak & 0xffff;
+	uint32_t b = weak >> 16;
+	a = (a - out + in) & 0xffff;
+	b = (b - (uint32_t)length * out + a) & 0xffff;
+	return (b << 16) | a;
+}
+
+void delta_strong_sum(const char *data, int length, uint8_t sum[DELTA_STRONG_SIZE]) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	EVP_Digest(data, length, digest, &digest_len, EVP_sha256(), NULL);
+	memcpy(sum, digest, DELTA_STRONG_SIZE);
+}
+
+std::vector<char> delta_signatures(const char *basis, uint64_t length) {
+	int block_size = delta_block_size(length);
+	uint32_t count = length / block_size;
+	std::vector<char> message(DELTA_HEADER_SIZE + (size_t)count * DELTA_SIGNATURE_SIZE);
+
+	uint32_t header[3] = { htonl(DELTA_MAGIC), htonl(block_size), htonl(count) };
+	memcpy(message.data(), header, DELTA_HEADER_SIZE);
+	char *signature = message.data() + DELTA_HEADER_SIZE;
+	for (uint32_t i = 0; i < count; i++) {
+		const char *block = basis + (uint64_t)i * block_size;
+		uint32_t weak = htonl(delta_weak_sum(block, block_size));
+		memcpy(signature, &weak, 4);
+		delta_strong_sum(block, block_size, (uint8_t*)signature + 4);
+		signature += DELTA_SIGNATURE_SIZE;
+	}
+	return message;
+}
+
+bool delta_parse_header(const char header[DELTA_HEADER_SIZE], int *block_size,
+		uint32_t *count) {
+	uint32_t fields[3];
+	memcpy(fields, header, DELTA_HEADER_SIZE);
+	*block_size = ntohl(fields[1]);
+	*count = ntohl(fields[2]);
+	return ntohl(fields[0]) == DELTA_MAGIC && *block_size > 0;
+}
+
+/*
+ * Emits runs of literal bytes, at most DELTA_MAX_LITERAL at a time.
+ */
+static void emit_literal(const char *data, uint64_t length, delta_emit_fn emit,
+		void *context) {
+	while (length > 0) {
+		uint32_t chunk = length > (uint64_t)DELTA_MAX_LITERAL ? DELTA_MAX_LITERAL : length;
+		char op[5];
+		op[0] = DELTA_LITERAL;
+		uint32_t chunk_net = htonl(chunk);
+		memcpy(op + 1, &chunk_net, 4);
+		emit(context, op, sizeof(op));
+		emit(context, data, chunk);
+		data += chunk;
+		length -= chunk;
+	}
+}
+
+/*
+ * Emits a copy of count blocks starting at first (if count isn't 0).
+ */
+static void emit_copy(uint32_t first, uint32_t count, delta_emit_fn emit,
+		void *context) {
+	if (count == 0) {
+		return;
+	}
+	char op[9];
+	op[0] = DELTA_COPY;
+	uint32_t fields[2] = { htonl(first), htonl(count) };
+	memcpy(op + 1, fields, 8);
+	emit(context, op, sizeof(op));
+}
+
+DeltaStats delta_encode(const char *signatures, uint32_t count, int block_size,
+		const char *data, uint64_t length, delta_emit_fn emit, void *context) {
+	// Index the basis blocks by rolling checksum. Most positions match
+	// nothing, so a bitmap is checked before the (slower) map.
+	std::unordered_map<uint32_t, std::vector<uint32_t>> blocks;
+	std::vector<bool> maybe(1 << 20);
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t weak;
+		memcpy(&weak, signatures + (size_t)i * DELTA_SIGNATURE_SIZE, 4);
+		weak = ntohl(weak);
+		blocks[weak].push_back(i);
+		maybe[(weak ^ (weak >> 12)) & 0xfffff] = true;
+	}
+
+	DeltaStats stats = {0, 0};
+	uint64_t pos = 0;
+	uint64_t literal_start = 0;
+	uint32_t run_first = 0, run_count = 0; // copies not yet emitted
+	uint32_t weak = 0;
+	if (count > 0 && length >= (uint64_t)block_size) {
+		weak = delta_weak_sum(data, block_size);
+	}
+
+	while (count > 0 && pos + block_size <= length) {
+		int64_t match = -1;
+		if (maybe[(weak ^ (weak >> 12)) & 0xfffff]) {
+			auto found = blocks.find(weak);
+			if (found != blocks.end()) {
+				uint8_t strong[DELTA_STRONG_SIZE];
+				delta_strong_sum(data + pos, block_size, strong);
+				for (uint32_t index : found->second) {
+					const char *sig = signatures + (size_t)index * DELTA_SIGNATURE_SIZE + 4;
+					if (memcmp(strong, sig, DELTA_STRONG_SIZE) == 0) {
+						match = index;
+						break;
+					}
+				}
+			}
+		}
+
+		if (match < 0) {
+			if (pos + block_size < length) {
+				weak = delta_roll(weak, data[pos], data[pos + block_size], block_size);
+			}
+			pos++;
+			continue;
+		}
+
+		// Send what didn't match since the last copy, then extend the run of
+		// copies or start a new one
+		if (pos > literal_start) {
+			emit_copy(run_first, run_count, emit, context);
+			run_count = 0;
+			emit_literal(data + literal_start, pos - literal_start, emit, context);
+			stats.literal_bytes += pos - literal_start;
+		}
+		if (run_count > 0 && (uint32_t)match == run_first + run_count) {
+			run_count++;
+		}
+		else {
+			emit_copy(run_first, run_count, emit, context);
+			run_first = match;
+			run_count = 1;
+		}
+		stats.copied_bytes += block_size;
+		pos += block_size;
+		literal_start = pos;
+		if (pos + block_size <= length) {
+			weak = delta_weak_sum(data + pos, block_size);
+		}
+	}
+
+	emit_copy(run_first, run_count, emit, context);
+	emit_literal(data + literal_start, length - literal_start, emit, context);
+	stats.literal_bytes += length - literal_start;
+
+	char end[17];
+	end[0] = DELTA_END;
+	uint64_t fields[2] = { htobe64(length), htobe64(hash_update(hash_init(), data, length)) };
+	memcpy(end + 1, fields, 16);
+	emit(context, end, sizeof(end));
+	return stats;
+}
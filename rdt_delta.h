@@ -0,0 +1,108 @@
+/*
+ * File: rdt_delta.h
+ *
+ * Header / API file for rsync-style delta transfers (sender -u, receiver
+ * -u), which send only the parts of a file the receiver doesn't already
+ * have.
+ *
+ * The receiver splits its existing copy (the basis) into blocks and sends
+ * a signature for each: a rolling checksum, cheap to slide along the new
+ * data one byte at a time, and a strong hash to confirm a match. The sender
+ * answers with a stream of operations rebuilding the new data from copies
+ * of basis blocks and literal bytes, ending with the new data's length and
+ * hash (see rdt_hash.h) so the receiver can check the result.
+ *
+ * Signature message: magic, block size and block count (DELTA_HEADER_SIZE
+ * bytes), then per block the 32-bit rolling checksum and the strong hash.
+ * Operations: DELTA_COPY, first block and number of blocks (32 bits each);
+ * DELTA_LITERAL, 32-bit length and the bytes; DELTA_END, 64-bit length and
+ * hash. Integers are in network byte order.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+const uint32_t DELTA_MAGIC = 0x52445344; // "RDSD"
+const int DELTA_HEADER_SIZE = 4 + 4 + 4;
+const int DELTA_STRONG_SIZE = 16;
+const int DELTA_SIGNATURE_SIZE = 4 + DELTA_STRONG_SIZE;
+const int DELTA_MAX_LITERAL = 64 * 1024;
+
+enum DeltaOp : uint8_t { DELTA_COPY = 'C', DELTA_LITERAL = 'L', DELTA_END = 'E' };
+
+// What delta_encode sent
+struct DeltaStats {
+	uint64_t literal_bytes;
+	uint64_t copied_bytes;
+};
+
+// Called by delta_encode with each piece of the operation stream
+typedef void (*delta_emit_fn)(void *context, const char *data, size_t length);
+
+/*
+ * Picks the block size for a basis of the given length: about its square
+ * root, which balances the size of the signatures against how much has to
+ * be resent around each change.
+ *
+ * @param length Length of the basis.
+ * @return The block size.
+ */
+int delta_block_size(uint64_t length);
+
+/*
+ * Computes the rolling checksum of a block.
+ */
+uint32_t delta_weak_sum(const char *data, int length);
+
+/*
+ * Slides a rolling checksum along by one byte.
+ *
+ * @param weak Checksum of the block starting at some position.
+ * @param out The byte at that position.
+ * @param in The byte just past the end of the block.
+ * @param length The block size.
+ * @return Checksum of the block starting one byte later.
+ */
+uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, int length);
+
+/*
+ * Computes the strong hash of a block (truncated SHA-256).
+ */
+void delta_strong_sum(const char *data, int length, uint8_t sum[DELTA_STRONG_SIZE]);
+
+/*
+ * Builds the signature message for a basis. Only whole blocks get a
+ * signature; a short block at the end is always resent.
+ *
+ * @param basis The receiver's existing data (may be NULL if length is 0).
+ * @param length Length of the basis.
+ * @return The message.
+ */
+std::vector<char> delta_signatures(const char *basis, uint64_t length);
+
+/*
+ * Reads the header of a signature message.
+ *
+ * @param header The DELTA_HEADER_SIZE header bytes.
+ * @param block_size Set to the block size.
+ * @param count Set to the number of signatures that follow.
+ * @return false if this isn't a signature message.
+ */
+bool delta_parse_header(const char header[DELTA_HEADER_SIZE], int *block_size,
+		uint32_t *count);
+
+/*
+ * Produces the operations that rebuild data from the basis described by a
+ * set of signatures.
+ *
+ * @param signatures The signatures (count * DELTA_SIGNATURE_SIZE bytes).
+ * @param count Number of signatures.
+ * @param block_size The block size.
+ * @param data The new data.
+ * @param length Length of the new data.
+ * @param emit Called with each piece of the operation stream, in order.
+ * @param context Passed to emit.
+ * @return How many bytes were sent literally and how many copied.
+ */
+DeltaStats delta_encode(const char *signatures, uint32_t count, int block_size,
+		const char *data, uint64_t length, delta_emit_fn emit, void *context);
@@ -0,0 +1,66 @@
+/*
+ * File: rdt_fec.cpp
+ *
+ * Reliable data transport (RDT) forward error correction implementation.
+ *
+ */
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "rdt_fec.h"
+
+uint32_t fec_pack_info(int group_size, int index, int extra) {
+	return ((uint32_t)group_size << 24) | ((uint32_t)(index & 0xFF) << 16)
+		| (uint32_t)(extra & 0xFFFF);
+}
+
+int fec_info_group_size(uint32_t info) {
+	return info >> 24;
+}
+
+int fec_info_index(uint32_t info) {
+	return (info >> 16) & 0xFF;
+}
+
+int fec_info_extra(uint32_t info) {
+	return info & 0xFFFF;
+}
+
+int fec_choose_group_size(double loss_rate, int current_size, int max_size) {
+	double threshold = (current_size > 0) ? FEC_AUTO_OFF_LOSS : FEC_AUTO_ON_LOSS;
+	if (loss_rate < threshold) {
+		return 0;
+	}
+
+	// Grow the group while the chance of two or more losses among its
+	// group_size + 1 segments (which parity alone can't repair) stays under 5%.
+	const double max_unrepairable = 0.05;
+	int best = 2;
+	for (int group_size = 2; group_size <= max_size; group_size++) {
+		int n = group_size + 1;
+		double none = pow(1 - loss_rate, n);
+		double one = n * loss_rate * pow(1 - loss_rate, n - 1);
+		if (1 - none - one > max_unrepairable) {
+			break;
+		}
+		best = group_size;
+	}
+	return best;
+}
+
+void fec_xor_into(char *dst, const char *src, size_t len) {
+	size_t i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(a, b));
+	}
+#endif
+	for (; i < len; i++) {
+		dst[i] ^= src[i];
+	}
+}
@@ -0,0 +1,77 @@
+/*
+ * File: rdt_fec.h
+ *
+ * Header / API file for the forward error correction (FEC) component of the
+ * RDT library.
+ *
+ * FEC segments carry their group layout in the (otherwise unused) ack_number
+ * field of the header: the group size in the top byte, the segment's index
+ * within the group in the next byte, and an extra 16-bit value (the XOR of the
+ * payload lengths, for parity segments) in the low half.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+// Set in a group ACK's bitmap when the ACK answers a parity segment, i.e. when
+// the sender has sent everything it will send this round.
+const uint32_t FEC_PARITY_SEEN = 1u << 31;
+
+// Bits 16 through 23 of a group ACK's bitmap count the segments (data and
+// parity) the receiver has actually received for the group, so the sender can
+// measure loss even when the receiver rebuilt what was lost.
+const int FEC_RECV_COUNT_SHIFT = 16;
+const uint32_t FEC_RECV_COUNT_MASK = 0xFFu << FEC_RECV_COUNT_SHIFT;
+
+// Loss rates at which automatic FEC is switched on and back off again. The gap
+// keeps a borderline link from flapping between modes.
+const double FEC_AUTO_ON_LOSS = 0.01;
+const double FEC_AUTO_OFF_LOSS = 0.005;
+
+/*
+ * Packs the group layout of an FEC segment into a 32-bit value.
+ *
+ * @param group_size Number of data segments in the group.
+ * @param index Index of this segment in the group (group_size for parity).
+ * @param extra Extra 16-bit value (length XOR for parity segments).
+ * @return The packed value, in host byte order.
+ */
+uint32_t fec_pack_info(int group_size, int index, int extra);
+
+/*
+ * Extracts the group size from a packed FEC layout (0 for non-FEC segments).
+ */
+int fec_info_group_size(uint32_t info);
+
+/*
+ * Extracts the segment index from a packed FEC layout.
+ */
+int fec_info_index(uint32_t info);
+
+/*
+ * Extracts the extra 16-bit value from a packed FEC layout.
+ */
+int fec_info_extra(uint32_t info);
+
+/*
+ * XORs len bytes of src into dst (i.e. dst ^= src).
+ *
+ * @note Uses 16-byte SSE2 operations when the compiler targets them, which
+ * all x86-64 compilers do by default.
+ *
+ * @param dst Buffer that is updated in place.
+ * @param src Buffer to XOR into dst.
+ * @param len Number of bytes to process.
+ */
+void fec_xor_into(char *dst, const char *src, size_t len);
+
+/*
+ * Picks an FEC group size for the given loss rate: the largest group (i.e.
+ * least redundancy) for which a group is unlikely to lose more segments than
+ * one parity segment can repair.
+ *
+ * @param loss_rate Estimated per-segment loss probability.
+ * @param current_size The group size currently in use (0 if FEC is off).
+ * @param max_size Largest group size allowed.
+ * @return The group size to use, or 0 if FEC should be off.
+ */
+int fec_choose_group_size(double loss_rate, int current_size, int max_size);
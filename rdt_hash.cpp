@@ -0,0 +1,28 @@
+/*
+ * File: rdt_hash.cpp
+ *
+ * Reliable data transport (RDT) running hash implementation.
+ *
+ */
+#include <zlib.h>
+
+#include "rdt_hash.h"
+
+uint64_t hash_init() {
+	return ((uint64_t)crc32(0, Z_NULL, 0) << 32) | adler32(0, Z_NULL, 0);
+}
+
+uint64_t hash_update(uint64_t hash, const void *data, size_t length) {
+	uLong crc = hash >> 32;
+	uLong adler = hash & 0xffffffff;
+	const Bytef *bytes = (const Bytef*)data;
+	// zlib takes lengths as uInt, so feed it at most 1GB at a time
+	while (length > 0) {
+		uInt chunk = length > (1u << 30) ? (1u << 30) : length;
+		crc = crc32(crc, bytes, chunk);
+		adler = adler32(adler, bytes, chunk);
+		bytes += chunk;
+		length -= chunk;
+	}
+	return ((uint64_t)crc << 32) | adler;
+}
@@ -0,0 +1,26 @@
+/*
+ * File: rdt_hash.h
+ *
+ * Header / API file for the running hash used to check that both ends of a
+ * resumed transfer hold the same data (see ReliableSocket::set_resume_offer).
+ *
+ * The hash combines zlib's CRC-32 and Adler-32 into 64 bits. Both can be
+ * updated a piece at a time, so it is kept up to date as data streams past.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Returns the hash of no data, to start from.
+ */
+uint64_t hash_init();
+
+/*
+ * Extends a hash with more data.
+ *
+ * @param hash The hash of the data so far.
+ * @param data The data that follows.
+ * @param length The length of data.
+ * @return The hash of the data so far followed by data.
+ */
+uint64_t hash_update(uint64_t hash, const void *data, size_t length);
@@ -0,0 +1,63 @@
+/*
+ * File: rdt_rate.cpp
+ *
+ * Reliable data transport (RDT) rate limiting implementation.
+ *
+ */
+#include <time.h>
+#include <mutex>
+#include <algorithm>
+
+#include "rdt_rate.h"
+
+struct RateBucket {
+	std::mutex mutex;
+	double rate; // bytes per second, 0 for no limit
+	double burst;
+	double tokens; // negative while in debt
+	int64_t updated; // when tokens was last brought up to date
+};
+
+// A monotonic clock, in nanoseconds
+static int64_t now_nsec() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+RateBucket *rate_new() {
+	RateBucket *bucket = new RateBucket;
+	bucket->rate = 0;
+	bucket->burst = 0;
+	bucket->tokens = 0;
+	bucket->updated = now_nsec();
+	return bucket;
+}
+
+void rate_free(RateBucket *bucket) {
+	delete bucket;
+}
+
+void rate_set(RateBucket *bucket, uint64_t rate, uint64_t burst) {
+	std::lock_guard<std::mutex> lock(bucket->mutex);
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = burst;
+	bucket->updated = now_nsec();
+}
+
+int64_t rate_take(RateBucket *bucket, int length) {
+	std::lock_guard<std::mutex> lock(bucket->mutex);
+	if (bucket->rate <= 0) {
+		return 0;
+	}
+	int64_t now = now_nsec();
+	bucket->tokens = std::min(bucket->burst,
+			bucket->tokens + (now - bucket->updated) * bucket->rate / 1e9);
+	bucket->updated = now;
+	bucket->tokens -= length;
+	if (bucket->tokens >= 0) {
+		return 0;
+	}
+	return (int64_t)(-bucket->tokens / bucket->rate * 1e9);
+}
@@ -0,0 +1,48 @@
+/*
+ * File: rdt_rate.h
+ *
+ * Header / API file for the rate limiting component of the RDT library.
+ *
+ * Limits are token buckets: a bucket fills at the limit rate, up to its
+ * burst size, and sending a segment takes its length in tokens. A sender
+ * takes the tokens at once, leaving the bucket in debt if there weren't
+ * enough, and then waits until the debt would be paid off. So senders
+ * sharing a bucket (e.g. threads with connections of their own) are served
+ * in the order they came, and once the burst is used up segments go out
+ * evenly spaced, one every length / rate seconds, rather than in bursts.
+ */
+#include <stdint.h>
+
+// A token bucket (opaque)
+struct RateBucket;
+
+/*
+ * Creates a bucket, with no limit to begin with.
+ *
+ * @return The new bucket, to be freed with rate_free.
+ */
+RateBucket *rate_new();
+
+/*
+ * Frees a bucket (NULL is allowed).
+ */
+void rate_free(RateBucket *bucket);
+
+/*
+ * Sets a bucket's limit, and fills it. Safe to call while other threads
+ * are taking from it.
+ *
+ * @param bucket The bucket.
+ * @param rate The limit, in bytes per second, or 0 for none.
+ * @param burst How many bytes can be sent at once after a quiet spell.
+ */
+void rate_set(RateBucket *bucket, uint64_t rate, uint64_t burst);
+
+/*
+ * Takes the tokens for sending some bytes.
+ *
+ * @param bucket The bucket.
+ * @param length How many bytes are being sent.
+ * @return How long to wait (in nanoseconds) before sending them.
+ */
+int64_t rate_take(RateBucket *bucket, int length);
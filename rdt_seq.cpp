@@ -0,0 +1,21 @@
+/*
+ * File: rdt_seq.cpp
+ *
+ * Reliable data transport (RDT) sequence number arithmetic implementation.
+ *
+ */
+#include "rdt_seq.h"
+#include "rdt_crypto.h"
+
+bool seq_random_isn(uint32_t *isn) {
+	return crypto_random(isn, sizeof(*isn));
+}
+
+uint64_t seq_unwrap(uint32_t wire, uint64_t reference) {
+	int32_t delta = (int32_t)(wire - (uint32_t)reference);
+	return reference + (int64_t)delta;
+}
+
+int64_t seq_compare(uint64_t a, uint64_t b) {
+	return (int64_t)(a - b);
+}
@@ -0,0 +1,38 @@
+/*
+ * File: rdt_seq.h
+ *
+ * Header / API file for sequence number arithmetic in the RDT library.
+ *
+ * Sequence numbers are kept as 64-bit counters, so a connection can't run out
+ * of them, but only the low 32 bits are sent. The receiver rebuilds the full
+ * value from the one it expects next, using serial number arithmetic (as in
+ * RFC 1982), which works as long as the two are less than 2^31 apart.
+ */
+#include <stdint.h>
+
+/*
+ * Picks a random initial sequence number, so segments left over from an
+ * earlier connection between the same ports don't look current.
+ *
+ * @param isn Filled in with the initial sequence number.
+ * @return false if no random number could be had.
+ */
+bool seq_random_isn(uint32_t *isn);
+
+/*
+ * Rebuilds the full 64-bit sequence number of a segment from the 32 bits
+ * that were sent.
+ *
+ * @param wire The sequence number from the segment (host byte order).
+ * @param reference A nearby sequence number, e.g. the one we expect next.
+ * @return The sequence number closest to reference whose low 32 bits are
+ * wire.
+ */
+uint64_t seq_unwrap(uint32_t wire, uint64_t reference);
+
+/*
+ * Compares two sequence numbers.
+ *
+ * @return Negative if a comes before b, 0 if equal, positive if after.
+ */
+int64_t seq_compare(uint64_t a, uint64_t b);
@@ -2,45 +2,789 @@
  * File: receiver.cpp
  *
  * Simple program that receives data from a remote host using the
- * RDT library, writing the received data to standard output.
+ * RDT library, writing the received data to standard output. With -d it
+ * instead unpacks the files sent by "sender -b" into a directory, and with -r
+ * it writes to a file, checkpointing its progress so an interrupted transfer
+ * can pick up where it left off. With -u it updates an existing file with a
+ * delta from "sender -u", and with -c it keeps the chunks it receives in a
+ * store so that "sender -c" need not send them again.
  * 
  * You should NOT modify this file.
  */
 
 // C++ standard libraries
 #include <string>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
 #include <chrono>
 #include <iostream>
-#include <array>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// getopt, writev, open, mkdir, mmap
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 // RDT library
 #include "ReliableSocket.h"
+#include "rdt_crypto.h"
+#include "rdt_batch.h"
+#include "rdt_hash.h"
+#include "rdt_delta.h"
+#include "rdt_cdc.h"
 
 using std::cerr;
 
-int main(int argc, char **argv) {	
-	if (argc != 2) { 
-		cerr << "Usage: " << argv[0] << " <listening port>\n";
+static void usage(char *prog) {
+	cerr << "Usage: " << prog << " [-z] [-k key file] [-t idle timeout] [-d directory | -r output file | -u file | -c chunk store] <listening port>\n";
+	exit(1);
+}
+
+// Number of received segments gathered into each write, and the most
+// batches that may wait for the writer thread
+static const int WRITE_BATCH = 128;
+static const int WRITE_QUEUE_BATCHES = 64;
+
+/*
+ * Bounded queue of loan batches handed from the receiving thread to the
+ * writer thread. An empty batch marks the end of the data.
+ */
+struct WriteQueue {
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<std::vector<RDTLoan>> batches;
+};
+
+/*
+ * Where the writer thread is in a batch stream (see rdt_batch.h): reading a
+ * header, then the name, then the file's contents (when fd is open). The
+ * contents go to a temporary file (temp), renamed to path once complete.
+ */
+struct BatchState {
+	std::string directory;
+	mode_t umask;
+	char header[BATCH_HEADER_SIZE];
+	int header_used;
+	uint64_t size;
+	uint32_t mode;
+	int name_length;
+	std::string name;
+	std::string path;
+	std::string temp;
+	int fd;
+	int files;
+	BatchState() : umask(022), header_used(0), size(0), mode(0), name_length(0),
+		fd(-1), files(0) {}
+};
+
+// Bytes written between checkpoints of a resumable receive
+static const uint64_t CHECKPOINT_INTERVAL = 16 * 1024 * 1024;
+
+/*
+ * Output file of a resumable receive (-r), with its checkpoint: the number
+ * of bytes written and known to be on disk, and their hash. The hash and
+ * offset include data written since the last checkpoint (unsaved bytes).
+ */
+struct ResumeState {
+	std::string checkpoint;
+	int fd;
+	uint64_t offset;
+	uint64_t hash;
+	uint64_t unsaved;
+	ResumeState() : fd(-1), offset(0), hash(hash_init()), unsaved(0) {}
+};
+
+/*
+ * Reads a checkpoint file.
+ *
+ * @return true if the file held a checkpoint.
+ */
+static bool load_checkpoint(const std::string &path, uint64_t *offset,
+		uint64_t *hash) {
+	FILE *file = fopen(path.c_str(), "r");
+	if (file == NULL) {
+		return false;
+	}
+	unsigned long long saved_offset, saved_hash;
+	bool ok = (fscanf(file, "%llu %llx", &saved_offset, &saved_hash) == 2);
+	fclose(file);
+	*offset = saved_offset;
+	*hash = saved_hash;
+	return ok;
+}
+
+/*
+ * Records how far a resumable receive has got. The data is flushed to disk
+ * first, so the checkpoint never claims more than is really there, and the
+ * checkpoint is replaced atomically.
+ */
+static void save_checkpoint(ResumeState &state) {
+	if (fdatasync(state.fd) < 0) {
+		perror("fdatasync");
+	}
+	std::string temp = state.checkpoint + ".tmp";
+	FILE *file = fopen(temp.c_str(), "w");
+	if (file == NULL) {
+		perror(temp.c_str());
+		return;
+	}
+	fprintf(file, "%llu %016llx\n", (unsigned long long)state.offset,
+			(unsigned long long)state.hash);
+	if (fclose(file) != 0 || rename(temp.c_str(), state.checkpoint.c_str()) < 0) {
+		perror(state.checkpoint.c_str());
+		return;
+	}
+	state.unsaved = 0;
+}
+
+/*
+ * Writes out a list of buffers in full, with as few writev calls as
+ * possible.
+ */
+static void write_all(int fd, std::vector<struct iovec> &iov) {
+	struct iovec *next = iov.data();
+	int left = iov.size();
+	while (left > 0) {
+		ssize_t written = writev(fd, next, std::min(left, IOV_MAX));
+		if (written < 0) {
+			perror("writev");
+			exit(1);
+		}
+		// Skip past whatever was written, which may end mid-buffer
+		while (left > 0 && (size_t)written >= next->iov_len) {
+			written -= next->iov_len;
+			next++;
+			left--;
+		}
+		if (left > 0) {
+			next->iov_base = (char*)next->iov_base + written;
+			next->iov_len -= written;
+		}
+	}
+	iov.clear();
+}
+
+/*
+ * Closes the file being unpacked and moves it into place, giving it the
+ * permissions it was sent with, less our umask. Set-user-ID, set-group-ID
+ * and sticky bits are never taken from the sender.
+ */
+static void finish_file(BatchState &state) {
+	if (fchmod(state.fd, state.mode & 0777 & ~state.umask) < 0) {
+		perror("fchmod");
+	}
+	close(state.fd);
+	state.fd = -1;
+	// Renaming replaces whatever is at the path, a symlink included,
+	// rather than writing through it
+	if (rename(state.temp.c_str(), state.path.c_str()) < 0) {
+		perror(state.path.c_str());
+		unlink(state.temp.c_str());
 		exit(1);
 	}
+	state.files++;
+}
+
+/*
+ * Creates the file whose header and name have just been read, along with
+ * any directories above it.
+ */
+static void start_file(BatchState &state) {
+	if (!batch_name_safe(state.name.c_str())) {
+		cerr << "ERROR: Refusing to write outside " << state.directory
+			<< ": " << state.name << "\n";
+		exit(1);
+	}
+	state.path = state.directory + "/" + state.name;
+	for (size_t slash = state.directory.size() + 1;
+			(slash = state.path.find('/', slash)) != std::string::npos; slash++) {
+		std::string parent = state.path.substr(0, slash);
+		if (mkdir(parent.c_str(), 0755) < 0 && errno != EEXIST) {
+			perror(parent.c_str());
+			exit(1);
+		}
+		// A symlink here would lead outside the directory
+		struct stat st;
+		if (lstat(parent.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+			cerr << "ERROR: Refusing to write outside " << state.directory
+				<< ": " << parent << " isn't a directory\n";
+			exit(1);
+		}
+	}
+	state.temp = state.path + ".rdtbatch.XXXXXX";
+	state.fd = mkstemp(&state.temp[0]);
+	if (state.fd < 0) {
+		perror(state.temp.c_str());
+		exit(1);
+	}
+	state.header_used = 0;
+	if (state.size == 0) {
+		finish_file(state);
+	}
+}
+
+/*
+ * Writes the data of a batch of loans to stdout (or the resumable output
+ * file) with as few writev calls as possible, or unpacks it into files if
+ * state is given, then hands the loans back to the socket.
+ */
+static void write_loans(ReliableSocket &socket, std::vector<RDTLoan> &loans,
+		BatchState *state, ResumeState *resume) {
+	std::vector<struct iovec> iov;
+	for (RDTLoan &loan : loans) {
+		const char *data = loan.data;
+		int length = loan.length;
+		if (state == NULL) {
+			iov.push_back({(void*)data, (size_t)length});
+			continue;
+		}
+
+		while (length > 0) {
+			int count;
+			if (state->fd >= 0) {
+				// File contents: gather them up, writing once the file is done
+				count = std::min<uint64_t>(length, state->size);
+				iov.push_back({(void*)data, (size_t)count});
+				state->size -= count;
+				if (state->size == 0) {
+					write_all(state->fd, iov);
+					finish_file(*state);
+				}
+			}
+			else if (state->header_used < BATCH_HEADER_SIZE) {
+				count = std::min(length, BATCH_HEADER_SIZE - state->header_used);
+				memcpy(state->header + state->header_used, data, count);
+				state->header_used += count;
+				if (state->header_used == BATCH_HEADER_SIZE) {
+					batch_parse_header(state->header, &state->size, &state->mode,
+							&state->name_length);
+					state->name.clear();
+					if (state->name_length == 0) {
+						cerr << "ERROR: File with no name in batch\n";
+						exit(1);
+					}
+				}
+			}
+			else {
+				count = std::min(length, state->name_length - (int)state->name.size());
+				state->name.append(data, count);
+				if ((int)state->name.size() == state->name_length) {
+					start_file(*state);
+				}
+			}
+			data += count;
+			length -= count;
+		}
+	}
+	if (resume != NULL) {
+		write_all(resume->fd, iov);
+		for (RDTLoan &loan : loans) {
+			resume->hash = hash_update(resume->hash, loan.data, loan.length);
+			resume->offset += loan.length;
+			resume->unsaved += loan.length;
+		}
+		if (resume->unsaved >= CHECKPOINT_INTERVAL) {
+			save_checkpoint(*resume);
+		}
+	}
+	else if (state == NULL) {
+		write_all(STDOUT_FILENO, iov);
+	}
+	else if (!iov.empty()) {
+		write_all(state->fd, iov); // part of a file that isn't finished yet
+	}
+
+	for (RDTLoan &loan : loans) {
+		socket.release_loan(loan);
+	}
+	loans.clear();
+}
+
+/*
+ * Adds a batch to the queue, waiting if the writer is too far behind.
+ */
+static void queue_batch(WriteQueue &queue, std::vector<RDTLoan> &batch) {
+	std::unique_lock<std::mutex> guard(queue.lock);
+	queue.changed.wait(guard, [&queue] {
+		return queue.batches.size() < (size_t)WRITE_QUEUE_BATCHES;
+	});
+	queue.batches.push_back(std::vector<RDTLoan>());
+	queue.batches.back().swap(batch);
+	queue.changed.notify_all();
+}
+
+/*
+ * Writer thread: writes queued batches out (see write_loans) until the end
+ * marker.
+ */
+static void write_batches(ReliableSocket &socket, WriteQueue &queue,
+		BatchState *state, ResumeState *resume) {
+	while (1) {
+		std::vector<RDTLoan> batch;
+		{
+			std::unique_lock<std::mutex> guard(queue.lock);
+			queue.changed.wait(guard, [&queue] { return !queue.batches.empty(); });
+			batch.swap(queue.batches.front());
+			queue.batches.pop_front();
+			queue.changed.notify_all();
+		}
+		if (batch.empty()) {
+			return;
+		}
+		write_loans(socket, batch, state, resume);
+	}
+}
+
+/*
+ * Receives the data stream, writing it out on a writer thread: to stdout,
+ * unpacked into files (batch_state), or to a checkpointed file (resume).
+ *
+ * @return The number of bytes received.
+ */
+static long long receive_stream(ReliableSocket &socket, BatchState *batch_state,
+		ResumeState *resume) {
+	// Borrow received segments straight from the socket and hand them, in
+	// batches, to a writer thread. This thread only receives (and ACKs), so
+	// a slow disk never holds up the connection unless the queue fills.
+	WriteQueue queue;
+	std::thread writer(write_batches, std::ref(socket), std::ref(queue),
+			batch_state, resume);
+	std::vector<RDTLoan> batch;
+	RDTLoan loan;
+	long long total_bytes = 0;
+	int bytes_received = socket.receive_loan(&loan);
+
+	if (resume != NULL) {
+		// The first receive tells us whether the sender took our offer. The
+		// writer thread hasn't been handed anything yet, so the output can
+		// still be set up safely.
+		if (socket.get_resume_offset() == 0) {
+			resume->offset = 0;
+			resume->hash = hash_init();
+		}
+		if (ftruncate(resume->fd, resume->offset) < 0
+				|| lseek(resume->fd, resume->offset, SEEK_SET) < 0) {
+			perror("output file");
+			exit(1);
+		}
+	}
+
+	// Keep receiving data until we do a receive that gives us 0 bytes (or
+	// the connection times out).
+	while (bytes_received > 0) {
+		total_bytes += loan.length;
+		batch.push_back(loan);
+		if ((int)batch.size() == WRITE_BATCH) {
+			cerr << "receiver: received " << batch.size() << " segments of app data\n";
+			queue_batch(queue, batch);
+		}
+		bytes_received = socket.receive_loan(&loan);
+	}
+	if (!batch.empty()) {
+		queue_batch(queue, batch);
+	}
+	queue_batch(queue, batch); // end marker
+	writer.join();
+	if (socket.get_error()) {
+		cerr << "ERROR: Lost the connection to the sender: "
+			<< socket.get_error().message() << "\n";
+		if (resume != NULL) {
+			// The writer has written everything received, so record it
+			// all, letting a resumed transfer carry on from here
+			save_checkpoint(*resume);
+		}
+		if (batch_state != NULL && batch_state->fd >= 0) {
+			unlink(batch_state->temp.c_str());
+		}
+		exit(1);
+	}
+	if (batch_state != NULL) {
+		if (batch_state->fd >= 0) {
+			cerr << "WARNING: Connection ended partway through "
+				<< batch_state->name << ", which was discarded\n";
+			close(batch_state->fd);
+			unlink(batch_state->temp.c_str());
+		}
+		else if (batch_state->header_used > 0) {
+			cerr << "WARNING: Connection ended partway through a file header\n";
+		}
+		cerr << "receiver: unpacked " << batch_state->files << " files into "
+			<< batch_state->directory << "\n";
+	}
+	if (resume != NULL) {
+		// Everything arrived, so there is nothing left to resume
+		if (fsync(resume->fd) < 0) {
+			perror("fsync");
+		}
+		close(resume->fd);
+		unlink(resume->checkpoint.c_str());
+	}
+	return total_bytes;
+}
+
+/*
+ * Reads exactly length bytes from the socket, or exits if the connection
+ * closes first.
+ */
+static void receive_exactly(ReliableSocket &socket, void *buffer, int length) {
+	if (socket.receive(buffer, length, RDT_WAITALL) != length) {
+		cerr << "ERROR: Connection closed in the middle of the delta\n";
+		exit(1);
+	}
+}
+
+/*
+ * Delta mode: sends the block signatures of the existing file, then
+ * rebuilds the file from the copies and literal data the sender answers
+ * with. The new version is written next to the old one and renamed over
+ * it once its length and hash check out.
+ *
+ * @return The number of bytes received.
+ */
+static long long receive_delta(ReliableSocket &socket, const char *path) {
+	// The current version, if there is one, is the basis
+	const char *basis = NULL;
+	uint64_t basis_length = 0;
+	mode_t mode = 0644;
+	int basis_fd = open(path, O_RDONLY);
+	struct stat st;
+	if (basis_fd >= 0 && fstat(basis_fd, &st) == 0) {
+		mode = st.st_mode & 07777;
+		basis_length = st.st_size;
+	}
+	if (basis_length > 0) {
+		void *map = mmap(NULL, basis_length, PROT_READ, MAP_PRIVATE, basis_fd, 0);
+		if (map == MAP_FAILED) {
+			perror(path);
+			exit(1);
+		}
+		basis = (const char*)map;
+	}
+
+	std::vector<char> signatures = delta_signatures(basis, basis_length);
+	socket.send_data(signatures.data(), signatures.size());
+	socket.flush();
+	int block_size;
+	uint32_t count;
+	delta_parse_header(signatures.data(), &block_size, &count);
+	cerr << "receiver: sent signatures of " << count << " blocks of "
+		<< block_size << " bytes\n";
+
+	std::string temp = std::string(path) + ".rdtdelta";
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror(temp.c_str());
+		exit(1);
+	}
+
+	long long total_bytes = 0;
+	uint64_t length = 0;
+	uint64_t hash = hash_init();
+	std::vector<char> literal(DELTA_MAX_LITERAL);
+	std::vector<struct iovec> iov;
+	while (1) {
+		char op;
+		receive_exactly(socket, &op, 1);
+		total_bytes++;
+		if (op == DELTA_COPY) {
+			uint32_t fields[2];
+			receive_exactly(socket, fields, sizeof(fields));
+			total_bytes += sizeof(fields);
+			uint64_t first = ntohl(fields[0]);
+			uint64_t blocks = ntohl(fields[1]);
+			if (first + blocks > count) {
+				cerr << "ERROR: Delta copies a block we don't have\n";
+				exit(1);
+			}
+			const char *data = basis + first * block_size;
+			iov.push_back({(void*)data, (size_t)(blocks * block_size)});
+			write_all(fd, iov);
+			hash = hash_update(hash, data, blocks * block_size);
+			length += blocks * block_size;
+		}
+		else if (op == DELTA_LITERAL) {
+			uint32_t literal_length;
+			receive_exactly(socket, &literal_length, sizeof(literal_length));
+			literal_length = ntohl(literal_length);
+			if (literal_length > (uint32_t)DELTA_MAX_LITERAL) {
+				cerr << "ERROR: Delta literal too long\n";
+				exit(1);
+			}
+			receive_exactly(socket, literal.data(), literal_length);
+			total_bytes += sizeof(literal_length) + literal_length;
+			iov.push_back({literal.data(), literal_length});
+			write_all(fd, iov);
+			hash = hash_update(hash, literal.data(), literal_length);
+			length += literal_length;
+		}
+		else if (op == DELTA_END) {
+			uint64_t fields[2];
+			receive_exactly(socket, fields, sizeof(fields));
+			total_bytes += sizeof(fields);
+			if (be64toh(fields[0]) != length || be64toh(fields[1]) != hash) {
+				cerr << "ERROR: Rebuilt file doesn't match the sender's; "
+					<< "leaving " << path << " as it was\n";
+				unlink(temp.c_str());
+				exit(1);
+			}
+			break;
+		}
+		else {
+			cerr << "ERROR: Unknown delta operation; is the sender running with -u?\n";
+			unlink(temp.c_str());
+			exit(1);
+		}
+	}
+
+	if (fchmod(fd, mode) < 0 || fsync(fd) < 0 || close(fd) < 0
+			|| rename(temp.c_str(), path) < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (basis != NULL) {
+		munmap((void*)basis, basis_length);
+	}
+	if (basis_fd >= 0) {
+		close(basis_fd);
+	}
+	cerr << "receiver: rebuilt " << length << " bytes from " << total_bytes
+		<< " bytes of delta\n";
+
+	// The sender closes the connection next
+	char extra;
+	if (socket.receive(&extra, 1) > 0) {
+		cerr << "WARNING: Unexpected data after the end of the delta\n";
+	}
+	return total_bytes;
+}
+
+/*
+ * Dedup mode: answers the sender's chunk queries from the chunk store and
+ * writes out the chunks that follow, whether sent or taken from the store,
+ * adding the new ones to the store.
+ *
+ * @return The number of bytes received.
+ */
+static long long receive_dedup(ReliableSocket &socket, const char *store) {
+	if (mkdir(store, 0755) < 0 && errno != EEXIST) {
+		perror(store);
+		exit(1);
+	}
+
+	long long total_bytes = 0;
+	uint64_t length = 0, reused = 0;
+	uint64_t hash = hash_init();
+	std::vector<char> chunk;
+	std::vector<struct iovec> iov;
+	while (1) {
+		char op;
+		receive_exactly(socket, &op, 1);
+		total_bytes++;
+		if (op == CDC_END) {
+			uint64_t fields[2];
+			receive_exactly(socket, fields, sizeof(fields));
+			total_bytes += sizeof(fields);
+			if (be64toh(fields[0]) != length || be64toh(fields[1]) != hash) {
+				cerr << "ERROR: Received data doesn't match what the sender sent\n";
+				exit(1);
+			}
+			break;
+		}
+		if (op != CDC_QUERY) {
+			cerr << "ERROR: Unknown dedup operation; is the sender running with -c?\n";
+			exit(1);
+		}
+
+		// Say which chunks of the batch we already have
+		uint32_t count;
+		receive_exactly(socket, &count, sizeof(count));
+		count = ntohl(count);
+		if (count > (uint32_t)CDC_QUERY_CHUNKS) {
+			cerr << "ERROR: Chunk query too long\n";
+			exit(1);
+		}
+		std::vector<uint8_t> hashes((size_t)count * CDC_HASH_SIZE);
+		receive_exactly(socket, hashes.data(), hashes.size());
+		total_bytes += sizeof(count) + hashes.size();
+		std::vector<uint8_t> have((count + 7) / 8);
+		for (uint32_t i = 0; i < count; i++) {
+			if (cdc_store_has(store, hashes.data() + (size_t)i * CDC_HASH_SIZE)) {
+				have[i / 8] |= 1 << (i % 8);
+			}
+		}
+		socket.send_data(have.data(), have.size());
+		socket.flush();
+
+		// Then take each chunk, in order, from the sender or the store
+		for (uint32_t i = 0; i < count; i++) {
+			const uint8_t *chunk_hash = hashes.data() + (size_t)i * CDC_HASH_SIZE;
+			receive_exactly(socket, &op, 1);
+			total_bytes++;
+			if (op == CDC_REF) {
+				if (!cdc_store_get(store, chunk_hash, chunk)) {
+					cerr << "ERROR: A chunk went missing from (or is damaged in) "
+						<< store << "\n";
+					exit(1);
+				}
+				reused += chunk.size();
+			}
+			else if (op == CDC_DATA) {
+				uint32_t chunk_length;
+				receive_exactly(socket, &chunk_length, sizeof(chunk_length));
+				chunk_length = ntohl(chunk_length);
+				if (chunk_length > (uint32_t)CDC_MAX_CHUNK) {
+					cerr << "ERROR: Chunk too long\n";
+					exit(1);
+				}
+				chunk.resize(chunk_length);
+				receive_exactly(socket, chunk.data(), chunk_length);
+				total_bytes += sizeof(chunk_length) + chunk_length;
+				uint8_t actual[CDC_HASH_SIZE];
+				cdc_hash(chunk.data(), chunk.size(), actual);
+				if (memcmp(actual, chunk_hash, CDC_HASH_SIZE) != 0) {
+					cerr << "ERROR: Chunk doesn't match its hash\n";
+					exit(1);
+				}
+				if (!cdc_store_put(store, chunk_hash, chunk.data(), chunk.size())) {
+					perror(store);
+					exit(1);
+				}
+			}
+			else {
+				cerr << "ERROR: Unknown dedup operation\n";
+				exit(1);
+			}
+			iov.push_back({chunk.data(), chunk.size()});
+			write_all(STDOUT_FILENO, iov);
+			hash = hash_update(hash, chunk.data(), chunk.size());
+			length += chunk.size();
+		}
+	}
+	cerr << "receiver: wrote " << length << " bytes, " << reused
+		<< " of them from the chunk store\n";
+
+	// The sender closes the connection next
+	char extra;
+	if (socket.receive(&extra, 1) > 0) {
+		cerr << "WARNING: Unexpected data after the end of the chunks\n";
+	}
+	return total_bytes;
+}
+
+int main(int argc, char **argv) {	
+	bool compress = false;
+	const char *key_file = NULL;
+	const char *directory = NULL;
+	const char *output_file = NULL;
+	const char *delta_file = NULL;
+	const char *store = NULL;
+	int idle_timeout = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:d:k:r:t:u:z")) != -1) {
+		switch (opt) {
+			case 't':
+				idle_timeout = std::stoi(optarg);
+				break;
+			case 'u':
+				delta_file = optarg;
+				break;
+			case 'c':
+				store = optarg;
+				break;
+			case 'r':
+				output_file = optarg;
+				break;
+			case 'd':
+				directory = optarg;
+				break;
+			case 'k':
+				key_file = optarg;
+				break;
+			case 'z':
+				compress = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1
+			|| (directory != NULL) + (output_file != NULL) + (delta_file != NULL)
+				+ (store != NULL) > 1) {
+		usage(argv[0]);
+	}
+
+	BatchState batch_state;
+	if (directory != NULL) {
+		if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+			perror(directory);
+			exit(1);
+		}
+		batch_state.directory = directory;
+		batch_state.umask = umask(0);
+		umask(batch_state.umask);
+	}
 
 	ReliableSocket socket;
-	socket.accept_connection(std::stoi(argv[1]));
+	socket.set_compression(compress);
+	socket.set_idle_timeout(idle_timeout * 1000, idle_timeout * 1000 / 3);
+	if (key_file != NULL) {
+		uint8_t key[CRYPTO_KEY_SIZE];
+		if (!crypto_load_key(key_file, key)) {
+			cerr << "Could not read a " << CRYPTO_KEY_SIZE * 2
+				<< " hex digit key from " << key_file << "\n";
+			exit(1);
+		}
+		socket.set_psk(key);
+	}
 
-	auto start_time = std::chrono::system_clock::now();
-	std::array<char, ReliableSocket::MAX_DATA_SIZE> segment;
-	int bytes_received = socket.receive_data(segment.data());		
+	// Offer to carry on from the last checkpoint, if the output file still
+	// holds everything it covers
+	ResumeState resume_state;
+	if (output_file != NULL) {
+		resume_state.checkpoint = std::string(output_file) + ".resume";
+		resume_state.fd = open(output_file, O_WRONLY | O_CREAT, 0644);
+		if (resume_state.fd < 0) {
+			perror(output_file);
+			exit(1);
+		}
+		uint64_t offset, hash;
+		struct stat st;
+		if (load_checkpoint(resume_state.checkpoint, &offset, &hash)
+				&& fstat(resume_state.fd, &st) == 0 && (uint64_t)st.st_size >= offset) {
+			socket.set_resume_offer(offset, hash);
+			resume_state.offset = offset;
+			resume_state.hash = hash;
+		}
+	}
 
-	// Keep receiving data until we do a receive that gives us 0 bytes.
-	int total_bytes = 0;
-	while (bytes_received != 0) {
-		cerr << "receiver: received " << bytes_received << " bytes of app data\n";
-		total_bytes += bytes_received;
+	if (!socket.accept_connection(std::stoi(argv[optind]))) {
+		cerr << "Could not accept a connection: " << socket.get_error().message() << "\n";
+		exit(1);
+	}
 
-		// write received data to stdout
-		fwrite(segment.data(), sizeof(char), bytes_received, stdout);
-		fflush(stdout);
-		bytes_received = socket.receive_data(segment.data());		
+	auto start_time = std::chrono::system_clock::now();
+	long long total_bytes;
+	if (delta_file != NULL) {
+		total_bytes = receive_delta(socket, delta_file);
+	}
+	else if (store != NULL) {
+		total_bytes = receive_dedup(socket, store);
+	}
+	else {
+		total_bytes = receive_stream(socket,
+				directory != NULL ? &batch_state : NULL,
+				output_file != NULL ? &resume_state : NULL);
 	}
 
 	auto end_time = std::chrono::system_clock::now();
@@ -52,6 +796,4 @@ int main(int argc, char **argv) {
 
 	cerr << "\nFinished receiving file, closing socket.\n";
 	socket.close_connection();
-
-	fflush(stdout);
 }
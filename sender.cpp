@@ -2,55 +2,593 @@
  * File: sender.cpp
  *
  * Simple program that sends data on standard input to a remote host using the
- * RDT library.
+ * RDT library. In batch mode (-b) it instead reads a list of file names, one
+ * per line, on standard input and sends all of those files, in delta mode
+ * (-u) it sends only the parts of standard input the receiver's copy lacks,
+ * and in dedup mode (-c) it skips chunks the receiver has seen before.
  * 
  * You should NOT modify this file.
  */
 
 // C++ standard libraries
 #include <string>
+#include <cerrno>
+#include <cstring>
 #include <chrono>
 #include <iostream>
-#include <array>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+
+// getopt, read, open, fstat, posix_fadvise
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
 
 // RDT library
 #include "ReliableSocket.h"
+#include "rdt_crypto.h"
+#include "rdt_batch.h"
+#include "rdt_hash.h"
+#include "rdt_delta.h"
+#include "rdt_cdc.h"
 
 using std::cerr;
 
-int main(int argc, char** argv) {	
-	if (argc != 3) {
-		cerr << "Usage: " << argv[0] << " <remote host> <remote port>\n";
+static void usage(char *prog) {
+	cerr << "Usage: " << prog << " [-b | -c | -u] [-z] [-k key file] [-t idle timeout] [-l rate limit] [-f fec group size|auto] <remote host> <remote port>\n";
+	exit(1);
+}
+
+/*
+ * Parses a rate limit in bytes per second, which may end in k, M or G
+ * (thousands, millions or billions).
+ *
+ * @return The rate, or 0 if it can't be parsed.
+ */
+static uint64_t parse_rate(const char *text) {
+	char *end;
+	double rate = strtod(text, &end);
+	switch (*end) {
+		case 'k': rate *= 1e3; end++; break;
+		case 'M': rate *= 1e6; end++; break;
+		case 'G': rate *= 1e9; end++; break;
+	}
+	if (*end != '\0' || !(rate >= 1)) {
+		return 0;
+	}
+	return (uint64_t)rate;
+}
+
+// Size of each read from stdin, and the most blocks read ahead of the socket
+static const int READ_BLOCK_SIZE = 1024 * 1024;
+static const int READ_AHEAD_BLOCKS = 8;
+
+/*
+ * Bounded queue of blocks read from stdin by the reader thread, waiting to
+ * be sent. An empty block marks the end of the input.
+ */
+struct ReadQueue {
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<std::vector<char>> blocks;
+};
+
+/*
+ * Block being filled by the reader thread: data holds READ_BLOCK_SIZE bytes,
+ * of which the first used are filled in.
+ */
+struct ReadBlock {
+	std::vector<char> data;
+	int used;
+	ReadBlock() : data(READ_BLOCK_SIZE), used(0) {}
+};
+
+/*
+ * Queues the filled part of a block, waiting while the reader is
+ * READ_AHEAD_BLOCKS ahead of the sending thread, and starts a new block.
+ */
+static void queue_block(ReadQueue &queue, ReadBlock &block) {
+	block.data.resize(block.used);
+	std::unique_lock<std::mutex> guard(queue.lock);
+	queue.changed.wait(guard, [&queue] {
+		return queue.blocks.size() < (size_t)READ_AHEAD_BLOCKS;
+	});
+	queue.blocks.push_back(std::vector<char>());
+	queue.blocks.back().swap(block.data);
+	queue.changed.notify_all();
+	guard.unlock();
+
+	block.data.resize(READ_BLOCK_SIZE);
+	block.used = 0;
+}
+
+/*
+ * Reads from a file into blocks, queueing each block that fills.
+ *
+ * @param queue The queue for filled blocks.
+ * @param block The block to add to.
+ * @param fd The file to read from.
+ * @param limit The most bytes to read.
+ * @param eager Whether to queue the block after every read, so data from a
+ * 		slow pipe is passed on as soon as it arrives.
+ * @return The number of bytes read (less than limit only at end of file).
+ */
+static uint64_t read_file(ReadQueue &queue, ReadBlock &block, int fd,
+		uint64_t limit, bool eager) {
+	// Let the kernel read ahead aggressively if this is a regular file
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	uint64_t total = 0;
+	while (total < limit) {
+		size_t room = std::min<uint64_t>(READ_BLOCK_SIZE - block.used, limit - total);
+		ssize_t num_bytes_read = read(fd, block.data.data() + block.used, room);
+		if (num_bytes_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (num_bytes_read < 0) {
+			perror("read");
+			exit(1);
+		}
+		if (num_bytes_read == 0) {
+			break;
+		}
+		block.used += num_bytes_read;
+		total += num_bytes_read;
+		if (eager || block.used == READ_BLOCK_SIZE) {
+			queue_block(queue, block);
+		}
+	}
+	return total;
+}
+
+/*
+ * Reader thread for a plain transfer: queues everything on stdin, then the
+ * end marker.
+ */
+static void read_stdin(ReadQueue &queue) {
+	ReadBlock block;
+	read_file(queue, block, STDIN_FILENO, UINT64_MAX, true);
+	queue_block(queue, block); // nothing left, so this is the end marker
+}
+
+/*
+ * Reader thread for batch mode: queues a header plus contents for each file
+ * named on stdin, then the end marker. Files are packed back to back into
+ * blocks, so thousands of small files cost a handful of blocks.
+ */
+static void read_batch(ReadQueue &queue) {
+	ReadBlock block;
+	std::string name;
+	while (std::getline(std::cin, name)) {
+		if (name.empty()) {
+			continue;
+		}
+		if (name.size() > (size_t)BATCH_MAX_NAME) {
+			cerr << "Skipping " << name << ": name too long\n";
+			continue;
+		}
+
+		// Strip leading slashes so the receiver accepts the name, and skip
+		// names it would refuse anyway (such as ones with ".." in them)
+		size_t start = name.find_first_not_of('/');
+		std::string sent_name = name.substr(start == std::string::npos ? 0 : start);
+		if (!batch_name_safe(sent_name.c_str())) {
+			cerr << "Skipping " << name << ": unsafe name\n";
+			continue;
+		}
+
+		int fd = open(name.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			cerr << "Skipping " << name << ": "
+				<< (fd < 0 ? strerror(errno) : "not a regular file") << "\n";
+			if (fd >= 0) {
+				close(fd);
+			}
+			continue;
+		}
+
+		if (READ_BLOCK_SIZE - block.used < BATCH_HEADER_SIZE + (int)sent_name.size()) {
+			queue_block(queue, block);
+		}
+		block.used += batch_pack_header(block.data.data() + block.used,
+				sent_name.c_str(), st.st_size, st.st_mode & 07777);
+
+		// The header promised st_size bytes, so send exactly that many
+		uint64_t got = read_file(queue, block, fd, st.st_size, false);
+		if (got < (uint64_t)st.st_size) {
+			cerr << "WARNING: " << name << " shrank while being sent, padding with zeros\n";
+			for (uint64_t left = st.st_size - got; left > 0; ) {
+				int zeros = std::min<uint64_t>(READ_BLOCK_SIZE - block.used, left);
+				memset(block.data.data() + block.used, 0, zeros);
+				block.used += zeros;
+				left -= zeros;
+				if (block.used == READ_BLOCK_SIZE) {
+					queue_block(queue, block);
+				}
+			}
+		}
+		close(fd);
+	}
+	if (block.used > 0) {
+		queue_block(queue, block);
+	}
+	queue_block(queue, block); // end marker
+}
+
+/*
+ * Reads and hashes the first offset bytes of stdin, to see if they are what
+ * the receiver says it already has. If not, stdin is rewound. Input that
+ * can't be rewound (such as a pipe) isn't read at all, and we start over.
+ *
+ * @return true if stdin matched and is now positioned after those bytes.
+ */
+static bool skip_prefix(uint64_t offset, uint64_t expected_hash) {
+	if (lseek(STDIN_FILENO, 0, SEEK_CUR) < 0) {
+		cerr << "Can't rewind the input if the receiver's partial copy doesn't match it,"
+			" so starting over\n";
+		return false;
+	}
+	posix_fadvise(STDIN_FILENO, 0, 0, POSIX_FADV_SEQUENTIAL);
+	std::vector<char> buffer(READ_BLOCK_SIZE);
+	uint64_t hash = hash_init();
+	uint64_t left = offset;
+	while (left > 0) {
+		ssize_t num_bytes_read = read(STDIN_FILENO, buffer.data(),
+				std::min<uint64_t>(left, buffer.size()));
+		if (num_bytes_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (num_bytes_read < 0) {
+			perror("read");
+			exit(1);
+		}
+		if (num_bytes_read == 0) {
+			break; // input is shorter than what the receiver has
+		}
+		hash = hash_update(hash, buffer.data(), num_bytes_read);
+		left -= num_bytes_read;
+	}
+	if (left == 0 && hash == expected_hash) {
+		return true;
+	}
+
+	cerr << "Receiver's partial copy doesn't match the input, starting over\n";
+	if (lseek(STDIN_FILENO, 0, SEEK_SET) < 0) {
+		cerr << "Can't rewind the input to start over; remove the receiver's checkpoint\n";
 		exit(1);
 	}
+	return false;
+}
 
-	int remote_port_num = std::stoi(argv[2]);
+/*
+ * Sends stdin (or, in batch mode, the files it names) as read by a reader
+ * thread, so sending never waits on input.
+ *
+ * @return The number of bytes sent.
+ */
+static long long send_stream(ReliableSocket &socket, bool batch) {
+	ReadQueue queue;
+	std::thread reader(batch ? read_batch : read_stdin, std::ref(queue));
+
+	// Send blocks until the reader hits the end of stdin
+	long long total_bytes = 0;
+	while (1) {
+		std::vector<char> block;
+		{
+			std::unique_lock<std::mutex> guard(queue.lock);
+			auto ready = [&queue] { return !queue.blocks.empty(); };
+			if (!queue.changed.wait_for(guard,
+						std::chrono::milliseconds(ReliableSocket::CORK_DELAY), ready)) {
+				// Input has stalled: send what is corked rather than sit on it,
+				// and keep the receiver from giving up on us
+				guard.unlock();
+				socket.flush();
+				guard.lock();
+				while (!queue.changed.wait_for(guard,
+							std::chrono::milliseconds(ReliableSocket::CORK_DELAY), ready)) {
+					guard.unlock();
+					socket.keepalive();
+					guard.lock();
+				}
+			}
+			block.swap(queue.blocks.front());
+			queue.blocks.pop_front();
+			queue.changed.notify_all();
+		}
+		if (block.empty()) {
+			break;
+		}
+		total_bytes += block.size();
+		socket.send_data(block.data(), block.size());
+		if (socket.get_error()) {
+			// The reader may be blocked on stdin or waiting for room, so
+			// leave without joining it (or running exit handlers under it)
+			cerr << "ERROR: Lost the connection to the receiver: "
+				<< socket.get_error().message() << "\n";
+			_exit(1);
+		}
+		cerr << "sender: sent " << block.size() << " bytes of app data\n";
+	}
+	reader.join();
+	return total_bytes;
+}
+
+/*
+ * Appends up to READ_BLOCK_SIZE more bytes of stdin to data.
+ *
+ * @return false at the end of stdin.
+ */
+static bool read_more(std::vector<char> &data) {
+	size_t used = data.size();
+	data.resize(used + READ_BLOCK_SIZE);
+	ssize_t num_bytes_read;
+	do {
+		num_bytes_read = read(STDIN_FILENO, data.data() + used, READ_BLOCK_SIZE);
+	} while (num_bytes_read < 0 && errno == EINTR);
+	if (num_bytes_read < 0) {
+		perror("read");
+		exit(1);
+	}
+	data.resize(used + num_bytes_read);
+	return num_bytes_read > 0;
+}
+
+/*
+ * Sends part of the delta operation stream (see delta_encode).
+ */
+static void emit_to_socket(void *context, const char *data, size_t length) {
+	((ReliableSocket*)context)->send_data(data, length);
+}
+
+/*
+ * Delta mode: fetches the block signatures of the receiver's copy, reads
+ * all of stdin and sends what it takes to turn that copy into stdin.
+ *
+ * @return The length of stdin.
+ */
+static long long send_delta(ReliableSocket &socket) {
+	char header[DELTA_HEADER_SIZE];
+	int block_size;
+	uint32_t count;
+	if (socket.receive(header, sizeof(header), RDT_WAITALL) != sizeof(header)
+			|| !delta_parse_header(header, &block_size, &count)) {
+		cerr << "Didn't get block signatures; is the receiver running with -u?\n";
+		exit(1);
+	}
+	std::vector<char> signatures((size_t)count * DELTA_SIGNATURE_SIZE);
+	if (socket.receive(signatures.data(), signatures.size(), RDT_WAITALL)
+			!= (int)signatures.size()) {
+		cerr << "Connection closed while receiving block signatures\n";
+		exit(1);
+	}
+
+	// The receiver is waiting on us from here on
+	std::vector<char> data;
+	while (read_more(data)) {
+		socket.keepalive();
+	}
+
+	DeltaStats stats = delta_encode(signatures.data(), count, block_size,
+			data.data(), data.size(), emit_to_socket, &socket);
+	cerr << "sender: " << stats.literal_bytes << " bytes sent literally, "
+		<< stats.copied_bytes << " bytes (" << count << " blocks of "
+		<< block_size << ") already at the receiver\n";
+	return data.size();
+}
+
+/*
+ * Asks the receiver which of a batch of chunks it holds, then sends the
+ * rest. Chunks repeated within the batch are only sent once.
+ *
+ * @return The number of bytes the receiver already held.
+ */
+static uint64_t send_chunks(ReliableSocket &socket, const char *data,
+		const std::vector<uint32_t> &lengths) {
+	uint32_t count = lengths.size();
+	std::vector<char> query(1 + 4 + (size_t)count * CDC_HASH_SIZE);
+	query[0] = CDC_QUERY;
+	uint32_t count_net = htonl(count);
+	memcpy(query.data() + 1, &count_net, 4);
+	const char *chunk = data;
+	for (uint32_t i = 0; i < count; i++) {
+		cdc_hash(chunk, lengths[i], (uint8_t*)query.data() + 5 + (size_t)i * CDC_HASH_SIZE);
+		chunk += lengths[i];
+	}
+	socket.send_data(query.data(), query.size());
+	socket.flush();
+
+	std::vector<uint8_t> have((count + 7) / 8);
+	if (socket.receive(have.data(), have.size(), RDT_WAITALL) != (int)have.size()) {
+		cerr << "Didn't get an answer to the chunk query; is the receiver running with -c?\n";
+		exit(1);
+	}
+
+	uint64_t reused = 0;
+	std::unordered_set<std::string> sent;
+	chunk = data;
+	for (uint32_t i = 0; i < count; i++) {
+		std::string hash(query.data() + 5 + (size_t)i * CDC_HASH_SIZE, CDC_HASH_SIZE);
+		if ((have[i / 8] & (1 << (i % 8))) || !sent.insert(hash).second) {
+			char op = CDC_REF;
+			socket.send_data(&op, 1);
+			reused += lengths[i];
+		}
+		else {
+			char op[5];
+			op[0] = CDC_DATA;
+			uint32_t length_net = htonl(lengths[i]);
+			memcpy(op + 1, &length_net, 4);
+			socket.send_data(op, sizeof(op));
+			socket.send_data(chunk, lengths[i]);
+		}
+		chunk += lengths[i];
+	}
+	return reused;
+}
+
+/*
+ * Dedup mode: cuts stdin into chunks and sends only those the receiver's
+ * chunk store lacks.
+ *
+ * @return The length of stdin.
+ */
+static long long send_dedup(ReliableSocket &socket) {
+	std::vector<char> data; // read but not yet sent
+	std::vector<uint32_t> lengths; // chunks of data in the current batch
+	size_t chunked = 0;
+	bool more = true;
+	uint64_t length = 0, reused = 0;
+	uint64_t hash = hash_init();
+	while (more || chunked < data.size()) {
+		// A chunk can only be cut once its longest possible extent is in
+		while (more && data.size() - chunked < (size_t)CDC_MAX_CHUNK) {
+			more = read_more(data);
+			socket.keepalive();
+		}
+		if (chunked < data.size()) {
+			size_t chunk = cdc_cut(data.data() + chunked, data.size() - chunked);
+			lengths.push_back(chunk);
+			chunked += chunk;
+		}
+		if ((int)lengths.size() == CDC_QUERY_CHUNKS
+				|| (!more && chunked == data.size() && !lengths.empty())) {
+			reused += send_chunks(socket, data.data(), lengths);
+			hash = hash_update(hash, data.data(), chunked);
+			length += chunked;
+			data.erase(data.begin(), data.begin() + chunked);
+			chunked = 0;
+			lengths.clear();
+		}
+	}
+
+	char end[17];
+	end[0] = CDC_END;
+	uint64_t fields[2] = { htobe64(length), htobe64(hash) };
+	memcpy(end + 1, fields, 16);
+	socket.send_data(end, sizeof(end));
+	cerr << "sender: " << length - reused << " bytes sent, " << reused
+		<< " bytes already in the receiver's chunk store\n";
+	return length;
+}
+
+int main(int argc, char** argv) {	
+	int fec_group_size = 0;
+	bool compress = false;
+	bool batch = false;
+	bool delta = false;
+	bool dedup = false;
+	const char *key_file = NULL;
+	int idle_timeout = 0;
+	uint64_t rate_limit = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "bcf:k:l:t:uz")) != -1) {
+		switch (opt) {
+			case 'l':
+				rate_limit = parse_rate(optarg);
+				if (rate_limit == 0) {
+					usage(argv[0]);
+				}
+				break;
+			case 't':
+				idle_timeout = std::stoi(optarg);
+				break;
+			case 'b':
+				batch = true;
+				break;
+			case 'u':
+				delta = true;
+				break;
+			case 'c':
+				dedup = true;
+				break;
+			case 'k':
+				key_file = optarg;
+				break;
+			case 'z':
+				compress = true;
+				break;
+			case 'f':
+				if (std::string(optarg) == "auto") {
+					fec_group_size = ReliableSocket::FEC_AUTO;
+				}
+				else {
+					fec_group_size = std::stoi(optarg);
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || batch + delta + dedup > 1) {
+		usage(argv[0]);
+	}
+
+	int remote_port_num = std::stoi(argv[optind + 1]);
 
 	// Create a reliable connection and connect to the specified remote host
 	ReliableSocket socket;
-	socket.connect_to_remote(argv[1], remote_port_num);
+	socket.set_compression(compress);
+	socket.set_idle_timeout(idle_timeout * 1000, idle_timeout * 1000 / 3);
+	socket.set_rate_limit(rate_limit);
+	if (key_file != NULL) {
+		uint8_t key[CRYPTO_KEY_SIZE];
+		if (!crypto_load_key(key_file, key)) {
+			cerr << "Could not read a " << CRYPTO_KEY_SIZE * 2
+				<< " hex digit key from " << key_file << "\n";
+			exit(1);
+		}
+		socket.set_psk(key);
+	}
+	if (!socket.connect_to_remote(argv[optind], remote_port_num)) {
+		cerr << "Could not connect: " << socket.get_error().message() << "\n";
+		exit(1);
+	}
+	socket.set_fec_group_size(fec_group_size);
+	// Pack reads into full segments, which are smaller than
+	// MAX_DATA_SIZE on encrypted connections
+	socket.set_cork(true);
 
-	// Create a char array and fill it with 0's
-	std::array<char, ReliableSocket::MAX_DATA_SIZE> buff;
-	buff.fill(0);
+	// If the receiver already has the start of the data, skip it
+	uint64_t resume_offset, resume_hash;
+	if (socket.get_resume_offer(&resume_offset, &resume_hash)) {
+		if (batch) {
+			cerr << "Batches can't be resumed, starting over\n";
+		}
+		else if (skip_prefix(resume_offset, resume_hash)) {
+			cerr << "Resuming after the first " << resume_offset << " bytes\n";
+			socket.resume();
+		}
+	}
 
 	auto start_time = std::chrono::system_clock::now();
-
-	// Use stdin as the source for the data we will be sending
-	int total_bytes = 0;
-	int num_bytes_read = 0;
-	while ((num_bytes_read = fread(buff.data(), 
-									sizeof(char), 
-									ReliableSocket::MAX_DATA_SIZE, 
-									stdin))) {
-		total_bytes += num_bytes_read;
-		socket.send_data(buff.data(), num_bytes_read);
-		cerr << "sender: sent " << num_bytes_read << " bytes of app data\n";
+	long long total_bytes;
+	if (delta) {
+		total_bytes = send_delta(socket);
+	}
+	else if (dedup) {
+		total_bytes = send_dedup(socket);
+	}
+	else {
+		total_bytes = send_stream(socket, batch);
 	}
 
 	auto end_time = std::chrono::system_clock::now();
 	std::chrono::duration<double> elapsed_seconds = end_time - start_time;
 
+	if (socket.get_error()) {
+		cerr << "ERROR: Lost the connection to the receiver: "
+			<< socket.get_error().message() << "\n";
+		exit(1);
+	}
+
 	cerr << "\nFinished sending, closing socket.\n";
 	socket.close_connection();
 
@@ -59,6 +597,10 @@ int main(int argc, char** argv) {
 			<< "(" << total_bytes / elapsed_seconds.count() << " Bps)\n";
 
 	cerr << "Estimated RTT:  " << socket.get_estimated_rtt() << " ms\n";
+	cerr << "Estimated loss: " << socket.get_loss_rate() * 100 << " %\n";
+	if (compress) {
+		cerr << "Compressed to:  " << socket.get_compression_ratio() * 100 << " %\n";
+	}
 
 	return 0;
 }
@@ -0,0 +1,14 @@
+
+import os, socket, sys, time
+host, port, seconds, rate = sys.argv[1], int(sys.argv[2]), float(sys.argv[3]), int(sys.argv[4])
+end = time.time() + seconds
+sent = 0
+start = time.time()
+while time.time() < end:
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.sendto(os.urandom(12) + bytes(4) + os.urandom(40), (host, port))
+    s.close()
+    sent += 1
+    delay = start + sent / rate - time.time()
+    if delay > 0:
+        time.sleep(delay)
@@ -1,96 +1,380 @@
 #!/usr/bin/python3
 
-from mininet.topo import Topo
-from mininet.net import Mininet
-from mininet.node import CPULimitedHost
-from mininet.link import TCLink
-from mininet.util import dumpNodeConnections
-from mininet.log import setLogLevel
-
-from sys import argv, exit
-from time import sleep
+from sys import exit
+from time import sleep, time
+import argparse
+import filecmp
+import heapq
+import itertools
+import os
 import os.path
+import random
+import select
+import socket
+import subprocess
+import threading
+import zlib
 
-class SingleSwitchTopo(Topo):
+# Each mode runs the transfer with these sender and receiver options (see
+# run_mode for how the input is prepared and the result checked).
+MODES = {
+    'plain':    ('', ''),
+    'fec':      ('-f 4', ''),
+    'fec-auto': ('-f auto', ''),
+    'compress': ('-z', '-z'),
+    'key':      ('-k test/key', '-k test/key'),
+    'batch':    ('-b', '-d test/batch'),
+    'resume':   ('', '-r test/resumed.txt'),
+    'delta':    ('-u', '-u test/delta.txt'),
+    'dedup':    ('-c', '-c test/store'),
+    'flood':    ('', ''),
+}
+
+BATCH_FILES = ['1000lines.txt', 'README.md', 'Makefile']
+
+# Sends forged SYNs (random ISN, connection ID and nonce, each from a new
+# port) at a steady rate: python3 -c FLOOD_SCRIPT host port seconds rate
+FLOOD_SCRIPT = '''
+import os, socket, sys, time
+host, port, seconds, rate = sys.argv[1], int(sys.argv[2]), float(sys.argv[3]), int(sys.argv[4])
+end = time.time() + seconds
+sent = 0
+start = time.time()
+while time.time() < end:
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.sendto(os.urandom(12) + bytes(4) + os.urandom(40), (host, port))
+    s.close()
+    sent += 1
+    delay = start + sent / rate - time.time()
+    if delay > 0:
+        time.sleep(delay)
+'''
+
+try:
+    from mininet.topo import Topo
+    from mininet.net import Mininet
+    from mininet.node import CPULimitedHost
+    from mininet.link import TCLink
+    from mininet.log import setLogLevel
+
+    class SingleSwitchTopo(Topo):
+        """
+        Class representing a network with a single switch connected to n hosts.
+        This switch has a max_queue_size of 2, forcing a stop-and-wait approach to sending.
+        """
+        def build(self, n=2, ms_delay=10, loss_rate=5):
+            switch = self.addSwitch('s1')
+            for h in range(n):
+                # Each host gets 50%/n of system CPU
+                host = self.addHost('h%s' % (h + 1), cpu=.5/n)
+
+                # 10 Mbps, 2 packet queue; delay and loss rate are parameters
+                self.addLink(host, switch, bw=10, delay='%dms' % (ms_delay), loss=loss_rate,
+                              max_queue_size=2, use_htb=True)
+except ImportError:
+    Mininet = None
+
+
+class Hop:
     """
-    Class representing a network with a single switch connected to n hosts.
-    This switch has a max_queue_size of 2, forcing a stop-and-wait approach to sending.
+    One direction of one link in the emulated network: packets wait in a
+    queue for a 10 Mbps transmitter, then take the link's delay to arrive.
+    As with mininet's netem queue, max_queue counts the packets on their way
+    through the delay too, and lost packets are dropped as they arrive.
     """
-    def build(self, n=2, ms_delay=10, loss_rate=5):
-        switch = self.addSwitch('s1')
-        for h in range(n):
-            # Each host gets 50%/n of system CPU
-            host = self.addHost('h%s' % (h + 1), cpu=.5/n)
+    def __init__(self, ms_delay, loss_rate, bw=10e6, max_queue=2):
+        self.delay = ms_delay / 1000
+        self.loss = loss_rate / 100
+        self.bw = bw
+        self.max_queue = max_queue
+        self.busy_until = 0
+        self.held = []
 
-            # 10 Mbps, 2 packet queue; delay and loss rate are parameters
-            self.addLink(host, switch, bw=10, delay='%dms' % (ms_delay), loss=loss_rate,
-                          max_queue_size=2, use_htb=True)
+    def admit(self, now, size):
+        """
+        Returns when a packet of size bytes, arriving now, leaves the hop, or
+        None if it is dropped.
+        """
+        self.held = [t for t in self.held if t > now]
+        if len(self.held) >= self.max_queue or random.random() < self.loss:
+            return None
+        self.busy_until = max(now, self.busy_until) + size * 8 / self.bw
+        leave = self.busy_until + self.delay
+        self.held.append(leave)
+        return leave
 
-def run_test(delay=10, loss=5):
+
+class EmulatedLink(threading.Thread):
     """
-    Runs the sender and receiver to transfer 1000lines.txt over the simulated network.
+    Stands in for the mininet network on this machine (--local): a UDP relay
+    between the sender and the receiver. Each direction crosses two hops
+    (host to switch and switch to host), like the topology above.
+    """
+    def __init__(self, listen_port, target_port, ms_delay, loss_rate):
+        super().__init__(daemon=True)
+        self.front = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.front.bind(('127.0.0.1', listen_port))
+        self.back = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.back.bind(('127.0.0.1', 0))
+        self.target = ('127.0.0.1', target_port)
+        self.client = None
+        self.hops = {
+            'up': [Hop(ms_delay, loss_rate), Hop(ms_delay, loss_rate)],
+            'down': [Hop(ms_delay, loss_rate), Hop(ms_delay, loss_rate)],
+        }
+        self.events = []
+        self.counter = itertools.count()
 
-    Parameters:
-    delay (int): The delay (in ms) to transfer across one line in the network.
-    loss (int): The loss rate for each link in the network.
+    def forward(self, direction, hop, data, now):
+        hops = self.hops[direction]
+        if hop == len(hops):
+            if direction == 'up':
+                self.back.sendto(data, self.target)
+            elif self.client is not None:
+                self.front.sendto(data, self.client)
+            return
+        leave = hops[hop].admit(now, len(data) + 28) # with IP and UDP headers
+        if leave is not None:
+            heapq.heappush(self.events, (leave, next(self.counter), direction, hop + 1, data))
+
+    def run(self):
+        while True:
+            now = time()
+            while self.events and self.events[0][0] <= now:
+                when, _, direction, hop, data = heapq.heappop(self.events)
+                self.forward(direction, hop, data, when)
+            timeout = max(0, self.events[0][0] - now) if self.events else None
+            readable, _, _ = select.select([self.front, self.back], [], [], timeout)
+            for sock in readable:
+                data, addr = sock.recvfrom(65536)
+                if sock is self.front:
+                    self.client = addr
+                    self.forward('up', 0, data, time())
+                else:
+                    self.forward('down', 0, data, time())
+
+
+class MininetHost:
+    """Runs commands on a mininet host."""
+    def __init__(self, host):
+        self.host = host
+
+    def IP(self):
+        return self.host.IP()
+
+    def start(self, command):
+        self.host.cmd(command + ' &')
+
+    def run(self, command):
+        self.host.cmd(command)
+        return int(self.host.cmd('echo $?'))
+
+    def wait(self):
+        self.host.cmd('wait $!')
+        return int(self.host.cmd('echo $?'))
+
+
+class LocalHost:
+    """Runs commands on this machine, in place of a mininet host (--local)."""
+    def __init__(self):
+        self.job = None
+
+    def IP(self):
+        return '127.0.0.1'
+
+    def start(self, command):
+        self.job = subprocess.Popen(command, shell=True)
+
+    def run(self, command):
+        return subprocess.run(command, shell=True).returncode
+
+    def wait(self):
+        return self.job.wait()
+
+
+def write_checkpoint(path, data):
     """
+    Writes the receiver's resume checkpoint for data (see the receiver's
+    save_checkpoint and rdt_hash.h).
+    """
+    crc = zlib.crc32(data)
+    adler = zlib.adler32(data)
+    with open(path, 'w') as f:
+        f.write('%d %016x\n' % (len(data), (crc << 32) | adler))
 
-    # Create network topology that creates 2 hosts separated by a single switch
-    topo = SingleSwitchTopo(n=2, ms_delay=delay, loss_rate=loss)
-    net = Mininet(topo=topo, host=CPULimitedHost, link=TCLink)
-    net.start()
 
-    h1, h2 = net.get( 'h1', 'h2' )
+def read(path):
+    with open(path, 'rb') as f:
+        return f.read()
 
-    # Try creating the test directory.
-    h1.cmd("mkdir test")
 
-    # remove old test files (if there are any in there currently)
-    h1.cmd("rm -f test/*")
+def run_mode(mode, sender, receiver, target, port, seconds, flood_rate):
+    """
+    Runs one transfer of 1000lines.txt (two for dedup) in the given mode and
+    checks the result.
 
-    # Have h2 run the receiver and store the received data in test/received-data.txt
-    print("Starting receiver on h2, port 2000... saving data to test/received-data.txt")
-    h2.cmd('timeout 10s ./receiver 2000 > test/received-data.txt 2> test/receiver-output.err.txt &')
+    Parameters:
+    mode (str): One of MODES.
+    sender, receiver: The hosts to run the sender and receiver on.
+    target (str): Where the sender sends to (host and port).
+    port (int): The port the receiver listens on.
+    seconds (int): How long to let each transfer run.
+    flood_rate (int): Forged SYNs per second, for the flood mode.
 
-    # Sleep for a short time (0.5 seconds) to allow the receiver to start running
-    sleep(0.5)
+    Returns:
+    (bool, float): Whether it passed, and the sender's completion time.
+    """
+    sender_args, receiver_args = MODES[mode]
+    original = read('1000lines.txt')
+    output = 'test/received-data.txt'
+    stdin = '1000lines.txt'
+    os.system('rm -rf test/batch test/resumed.txt* test/delta.txt* test/key')
+    if mode == 'key':
+        with open('test/key', 'w') as f:
+            f.write(os.urandom(32).hex() + '\n')
+    elif mode == 'batch':
+        with open('test/batch-list', 'w') as f:
+            f.write('\n'.join(BATCH_FILES) + '\n')
+        stdin = 'test/batch-list'
+    elif mode == 'resume':
+        # As if an earlier transfer stopped halfway
+        half = original[:len(original) // 2]
+        with open('test/resumed.txt', 'wb') as f:
+            f.write(half)
+        write_checkpoint('test/resumed.txt.resume', half)
+        output = 'test/resumed.txt'
+    elif mode == 'delta':
+        # An older copy, with every 50th line different
+        lines = original.split(b'\n')
+        for i in range(0, len(lines), 50):
+            lines[i] = b'an older version of this line'
+        with open('test/delta.txt', 'wb') as f:
+            f.write(b'\n'.join(lines))
+        output = 'test/delta.txt'
+    elif mode == 'dedup':
+        os.system('rm -rf test/store')
+    if mode == 'flood':
+        with open('test/synflood.py', 'w') as f:
+            f.write(FLOOD_SCRIPT)
+        # The flood goes straight to the receiver, starting before the sender
+        # connects, so the handshake has to get through it
+        sender.start(f"python3 test/synflood.py {receiver.IP()} {port} {seconds} {flood_rate}")
+        sleep(0.5)
+
+    passes = 2 if mode == 'dedup' else 1
+    elapsed = 0
+    ok = True
+    for _ in range(passes):
+        receiver.start(f"timeout {seconds}s ./receiver {receiver_args} {port} > test/received-data.txt 2> test/receiver-output.err.txt")
+        sleep(0.5)
+        start = time()
+        status = sender.run(f"timeout {seconds}s ./sender {sender_args} {target} < {stdin} > test/sender-output.txt 2> test/sender-output.err.txt")
+        elapsed = time() - start
+        receiver_status = receiver.wait()
+        if status == 124:
+            print(f"\tERROR: Sender timed out after {seconds} seconds.")
+        if receiver_status == 124:
+            print(f"\tERROR: Receiver timed out after {seconds} seconds.")
+        ok = ok and status == 0 and receiver_status == 0
+
+    if mode == 'batch':
+        for name in BATCH_FILES:
+            copy = os.path.join('test/batch', name)
+            ok = ok and os.path.isfile(copy) and filecmp.cmp(name, copy, shallow=False)
+    elif os.path.isfile(output):
+        ok = ok and read(output) == original
+    else:
+        print(f"\tERROR: Couldn't find the file {output}")
+        ok = False
 
-    # Have h1 run the sender to transfer the file
-    print("Starting sender on h1...")
-    h1.cmd(f"timeout 10s ./sender {h2.IP()} 2000 < 1000lines.txt > test/sender-output.txt 2> test/sender-output.err.txt")
+    # The modes that skip data must really have skipped it
+    sender_err = read('test/sender-output.err.txt').decode(errors='replace')
+    receiver_err = read('test/receiver-output.err.txt').decode(errors='replace')
+    if mode == 'resume' and 'Resuming after the first' not in sender_err:
+        print("\tERROR: The sender didn't resume.")
+        ok = False
+    if mode == 'dedup' and ' 0 of them from the chunk store' in receiver_err:
+        print("\tERROR: The second transfer didn't use the chunk store.")
+        ok = False
+    return ok, elapsed
 
-    # check to see if either sender (h1) or receiver (h2) timed out
-    h1_exit_status = h1.cmd("echo $?")
-    h2_exit_status = h2.cmd("echo $?")
 
-    # Note: 124 is the value returned by the timeout program if there was a timeout
-    if h1_exit_status.strip() == "124":
-        print("ERROR: Sender timed out after 10 seconds.")
-    if h2_exit_status.strip() == "124":
-        print("ERROR: Receiver timed out after 10 seconds.")
+def run_test(delay=10, loss=5, modes=['plain'], local=False, seconds=10, port=2000, flood_rate=2000):
+    """
+    Runs the sender and receiver to transfer 1000lines.txt over the simulated network.
 
-    if not os.path.isfile("test/received-data.txt"):
-        print("ERROR: Couldn't find the file test/received-data.txt")
+    Parameters:
+    delay (int): The delay (in ms) to transfer across one line in the network.
+    loss (int): The loss rate for each link in the network.
+    modes (list): Which of MODES to run.
+    local (bool): Whether to emulate the network on this machine rather than
+        build it with mininet.
+    seconds (int): How long to let each transfer run.
+    port (int): The port the receiver listens on.
+    flood_rate (int): Forged SYNs per second, for the flood mode.
+
+    Returns:
+    bool: Whether every mode passed.
+    """
+
+    net = None
+    if local:
+        # The sender goes through the emulated link, listening on the next port
+        h1, h2 = LocalHost(), LocalHost()
+        EmulatedLink(port + 1, port, delay, loss).start()
+        target = f"127.0.0.1 {port + 1}"
     else:
-        print("\nComparing md5sum of original and received file.")
-        original_md5 = h1.cmd("md5sum 1000lines.txt").split()[0]
-        received_md5 = h1.cmd("md5sum test/received-data.txt").split()[0]
-        print(f"\tOriginal: {original_md5}")
-        print(f"\tReceived: {received_md5}")
-        if original_md5 == received_md5:
-            print("\n\tSUCCESS: md5sums are the same!")
-        else:
-            print("\n\tFAILED: md5sums did not match!")
+        # Create network topology that creates 2 hosts separated by a single switch
+        topo = SingleSwitchTopo(n=2, ms_delay=delay, loss_rate=loss)
+        net = Mininet(topo=topo, host=CPULimitedHost, link=TCLink)
+        net.start()
+        h1, h2 = (MininetHost(h) for h in net.get('h1', 'h2'))
+        target = f"{h2.IP()} {port}"
 
-    net.stop()
+    # Try creating the test directory.
+    os.makedirs('test', exist_ok=True)
+
+    # remove old test files (if there are any in there currently)
+    os.system('rm -rf test/*')
+
+    all_ok = True
+    for mode in modes:
+        print(f"Running {mode} (sender {MODES[mode][0] or '-'}, receiver {MODES[mode][1] or '-'})")
+        ok, elapsed = run_mode(mode, h1, h2, target, port, seconds, flood_rate)
+        print(f"\t{'SUCCESS' if ok else 'FAILED'}: sender finished in {elapsed:.2f} s")
+        all_ok = all_ok and ok
+
+    if net is not None:
+        net.stop()
+    return all_ok
 
 
 if __name__ == '__main__':
-    if len(argv) != 3:
-        exit("Usage: %s delay loss_rate" % argv[0])
+    parser = argparse.ArgumentParser(description='Transfer 1000lines.txt over a simulated network.')
+    parser.add_argument('delay', type=int, help='delay (in ms) of each link')
+    parser.add_argument('loss_rate', type=int, help='loss rate (in percent) of each link')
+    parser.add_argument('--mode', action='append', choices=list(MODES) + ['all'],
+                        help='mode to test (repeatable; default plain)')
+    parser.add_argument('--local', action='store_true',
+                        help='emulate the network on this machine instead of using mininet')
+    parser.add_argument('--seconds', type=int, default=10, help='time limit for each transfer')
+    parser.add_argument('--port', type=int, default=2000, help='port the receiver listens on')
+    parser.add_argument('--flood-rate', type=int, default=2000, help='forged SYNs per second (flood mode)')
+    parser.add_argument('--seed', type=int, help='seed for the emulated loss (--local)')
+    args = parser.parse_args()
+
+    modes = args.mode or ['plain']
+    if 'all' in modes:
+        modes = list(MODES)
+    if not args.local and Mininet is None:
+        exit("mininet isn't installed: use --local to emulate the network")
+    if args.seed is not None:
+        random.seed(args.seed)
 
-    print("Delay (ms): ", argv[1])
-    print("Loss Rate: ", argv[2])
+    print("Delay (ms): ", args.delay)
+    print("Loss Rate: ", args.loss_rate)
 
-    setLogLevel( 'info' )
-    run_test(delay=int(argv[1]), loss=int(argv[2]))
+    if not args.local:
+        setLogLevel( 'info' )
+    exit(0 if run_test(args.delay, args.loss_rate, modes, args.local, args.seconds,
+                       args.port, args.flood_rate) else 1)